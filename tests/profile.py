@@ -44,8 +44,13 @@ MEASUREMENTS = [
     ('L1_cache_misses', 'm'),
     ('L2_cache_misses', 'm'),
     ('branch_mispredicts', 'm'),
+    ('dTLB_misses', 'm'),
 ]
 
+# Measurements that need the cpu's performance counters, which not
+# every machine has, these are only taken when asked for
+OPTIONAL_MEASUREMENTS = ['dTLB_misses']
+
 UNITS = collections.defaultdict(lambda: 'i', MEASUREMENTS)
 PREFIXES = shplot.PREFIXES
 COLORS = [c for c in shplot.COLORS if not re.search('(black|white)', c)]
@@ -66,7 +71,8 @@ if not TEST_CASES:
                 TEST_CASES.append(match.group(1))
 
 if not TEST_MEASUREMENTS:
-    TEST_MEASUREMENTS = [m for m, _ in MEASUREMENTS]
+    TEST_MEASUREMENTS = [m for m, _ in MEASUREMENTS
+        if m not in OPTIONAL_MEASUREMENTS]
 
 TEST_MEASUREMENTS = list(reduce(itertools.chain,
     (TEST_CASES if m == 'runtime' else [m] for m in TEST_MEASUREMENTS), []))
@@ -193,6 +199,42 @@ def profile_callgrind(class_, size):
 
     return {m: r/len(TEST_CASES) for m, r in results}
 
+# Measurements from the cpu's performance counters
+def profile_dtlb(class_, size):
+    if 'dTLB_misses' not in TEST_MEASUREMENTS:
+        return {}
+
+    status.progress('compiling dTLB measurements')
+    compile(class_, TEST_CASES, flags=[
+        '-DTEST_RUNTIME=0', '-DTEST_INSTRUCTIONS=0', '-DTEST_HEAP=0',
+        '-DTEST_DTLB=1'])
+
+    status.progress('running dTLB measurements (%d)' % size)
+    command = [TARGET, '%d' % size]
+    proc = subprocess.Popen(command, stdout=subprocess.PIPE)
+
+    prefixes = {p: u for u, p in PREFIXES.items()}
+    dtlb_pattern = re.compile(
+        '(\w*):.*?([\d.]+)([%s]?) dTLB' % ''.join(prefixes))
+
+    misses = []
+    for line in proc.stdout:
+        match = dtlb_pattern.match(line)
+        if match:
+            misses.append(float(match.group(2)) * 10**prefixes[match.group(3)])
+
+    err = proc.wait()
+    if err:
+        raise subprocess.CalledProcessError(err, command)
+
+    if not misses:
+        # no counters, note it and leave the measurement out
+        status.result('dTLB_misses', 'no dTLB counters available, skipped')
+        TEST_MEASUREMENTS.remove('dTLB_misses')
+        return {}
+
+    return {'dTLB_misses': sum(misses)/len(misses)}
+
 # Finds test measurements, logs summary for each class
 # as measurements are generated
 def test_measurements():
@@ -213,6 +255,11 @@ def test_measurements():
                 for m in set(TEST_MEASUREMENTS) & set(callgrind):
                     results[class_][m].append(callgrind[m])
 
+            for size in exponential():
+                dtlb = profile_dtlb(class_, size)
+                for m in set(TEST_MEASUREMENTS) & set(dtlb):
+                    results[class_][m].append(dtlb[m])
+
             for m in TEST_MEASUREMENTS:
                 status.result(m, shplot.unitfy(
                     results[class_][m][-1], UNITS[m]))
@@ -12,15 +12,47 @@
 #include <random>
 #include <cassert>
 #include <cmath>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
 
 // Test classes
 #include <map>
+#include <set>
 #include <unordered_map>
 #include "trees/naive_utree.hpp"
 #include "trees/compact_utree.hpp"
 #include "trees/linear_utree.hpp"
 #include "trees/naive_sgtree.hpp"
 #include "trees/compact_sgtree.hpp"
+#include "trees/mapped_sgtree.hpp"
+#include "trees/hugepage_allocator.hpp"
+
+template <typename K, typename V, typename C=std::less<K>>
+using hugepage_sgtree = compact_sgtree<K, V, C, std::ratio<1,2>,
+    std::false_type, std::false_type, std::false_type,
+    hugepage_allocator<std::pair<const K, V>>>;
+
+template <typename K, typename V, typename C=std::less<K>>
+using small_sgtree6 = small_sgtree<K, V, C, 6>;
+
+template <typename K, typename V, typename C=std::less<K>>
+using fixed_sgtree6 = fixed_sgtree<K, V, C, 6>;
+
+// sets run the same tests as maps, they just don't keep the values
+template <typename K, typename V, typename C=std::less<K>>
+using std_set = std::set<K, C>;
+
+template <typename K, typename V, typename C=std::less<K>>
+using naive_sgset = naive_sgtree_set<K, C>;
+
+template <typename K, typename V, typename C=std::less<K>>
+using compact_sgset = compact_sgtree_set<K, C>;
+
+template <typename K, typename V, typename C=std::less<K>>
+using compact_wsgset = compact_wsgtree_set<K, C>;
 
 #ifndef TEST_SIZE
 #define TEST_SIZE 16384
@@ -42,12 +74,34 @@
 #define TEST_HEAP true
 #endif
 
+#ifndef TEST_DTLB
+#define TEST_DTLB false
+#endif
+
 #ifndef TEST_CASES
 #define TEST_CASES                  \
     test_case(lookups_test);        \
+    test_case(records_test);        \
     test_case(insertions_test);     \
+    test_case(pathological_test);   \
+    test_case(latency_test);        \
     test_case(deletions_test);      \
-    test_case(iteration_test);
+    test_case(purge_test);          \
+    test_case(sweep_test);          \
+    test_case(teardown_test);       \
+    test_case(small_test);          \
+    test_case(iteration_test);      \
+    test_case(range_test);          \
+    test_case(rank_test);           \
+    test_case(strings_test);        \
+    test_case(bulk_test);           \
+    test_case(reopen_test);         \
+    test_case(snapshot_test);       \
+    test_case(batch1_test);         \
+    test_case(batch4_test);         \
+    test_case(batch16_test);        \
+    test_case(batch64_test);        \
+    test_case(batch256_test);
 #endif
 
 #ifndef TEST_CLASSES
@@ -55,7 +109,14 @@
     test_class(std::map);           \
     test_class(std::unordered_map); \
     test_class(naive_sgtree);       \
-    test_class(compact_sgtree);
+    test_class(naive_wsgtree);      \
+    test_class(compact_sgtree);     \
+    test_class(compact_wsgtree);    \
+    test_class(split_sgtree);       \
+    test_class(incremental_sgtree); \
+    test_class(std_set);            \
+    test_class(naive_sgset);        \
+    test_class(compact_sgset);
 #endif
 
 
@@ -88,10 +149,20 @@ static inline test_cycle_t test_cycle() {
 static size_t test_heap_current;
 static size_t test_heap_max;
 
+// heap still held at a point the test cares about
+static size_t test_heap_kept;
+
+// allocations made while measuring
+static size_t test_heap_allocs;
+static size_t test_heap_allocs_start;
+static size_t test_heap_allocs_duration;
+
 extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
 extern "C" void __libc_free(void *p);
 
 extern "C" void *malloc(size_t size) throw () {
+    test_heap_allocs += 1;
     test_heap_current += size;
     if (test_heap_current > test_heap_max) {
         test_heap_max = test_heap_current;
@@ -102,6 +173,33 @@ extern "C" void *malloc(size_t size) throw () {
     return &m[1];
 }
 
+extern "C" void *realloc(void *p, size_t size) throw () {
+    if (!p) {
+        return malloc(size);
+    }
+
+    size_t *m = static_cast<size_t*>(p) - 1;
+    size_t old = m[0];
+    size_t *n = static_cast<size_t*>(__libc_realloc(m, size + sizeof(size)));
+    if (!n) {
+        return nullptr;
+    }
+
+    // a block that moves has both copies live while it's copied,
+    // only growing in place, like mremap does, skips that
+    if (n != m && test_heap_current + size > test_heap_max) {
+        test_heap_max = test_heap_current + size;
+    }
+
+    test_heap_current += size - old;
+    if (test_heap_current > test_heap_max) {
+        test_heap_max = test_heap_current;
+    }
+
+    n[0] = size;
+    return &n[1];
+}
+
 extern "C" void free(void *p) throw () {
     if (!p) {
         return;
@@ -113,6 +211,42 @@ extern "C" void free(void *p) throw () {
 }
 #endif
 
+#if TEST_DTLB
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int test_dtlb_fd = -1;
+static uint64_t test_dtlb_start;
+static uint64_t test_dtlb_duration;
+
+// dTLB load misses from the cpu's own counters, most VMs don't
+// expose these, in which case nothing is counted or printed
+static inline uint64_t test_dtlb() {
+    static bool opened = false;
+    if (!opened) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        test_dtlb_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        opened = true;
+    }
+
+    uint64_t count = 0;
+    if (test_dtlb_fd < 0 ||
+            read(test_dtlb_fd, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+#endif
+
 class test_random {
 private:
     std::default_random_engine _rand;
@@ -170,6 +304,12 @@ static inline void test_start() {
 #if TEST_INSTRUCTIONS
     test_cycle_start = test_cycle();
 #endif
+#if TEST_HEAP
+    test_heap_allocs_start = test_heap_allocs;
+#endif
+#if TEST_DTLB
+    test_dtlb_start = test_dtlb();
+#endif
 #ifdef TEST_SETUP
     TEST_SETUP;
 #endif
@@ -187,6 +327,46 @@ static inline void test_stop() {
     test_time_stop = test_clock::now();
     test_time_duration += test_time_stop - test_time_start;
 #endif
+#if TEST_HEAP
+    test_heap_allocs_duration += test_heap_allocs - test_heap_allocs_start;
+#endif
+#if TEST_DTLB
+    test_dtlb_duration += test_dtlb() - test_dtlb_start;
+#endif
+}
+
+// Records how much heap is still in use, for tests that
+// care about what's left behind rather than the peak
+static inline void test_keep() {
+#if TEST_HEAP
+    test_heap_kept = test_heap_current;
+#endif
+}
+
+// Like test_stop, but only keeps the slowest measurement
+// instead of the total, for catching latency spikes
+static inline void test_stop_worst() {
+#ifdef TEST_SETDOWN
+    TEST_SETDOWN;
+#endif
+#if TEST_INSTRUCTIONS
+    test_cycle_stop = test_cycle();
+    test_cycle_duration = std::max(test_cycle_duration,
+            test_cycle_stop - test_cycle_start);
+#endif
+#if TEST_RUNTIME
+    test_time_stop = test_clock::now();
+    test_time_duration = std::max(test_time_duration,
+            test_time_stop - test_time_start);
+#endif
+#if TEST_HEAP
+    test_heap_allocs_duration = std::max(test_heap_allocs_duration,
+            test_heap_allocs - test_heap_allocs_start);
+#endif
+#if TEST_DTLB
+    test_dtlb_duration = std::max(test_dtlb_duration,
+            test_dtlb() - test_dtlb_start);
+#endif
 }
 
 template <template <typename ...> class M, typename F>
@@ -200,6 +380,11 @@ void test_case(const std::string &name, F test) {
 #if TEST_HEAP
     test_heap_current = 0;
     test_heap_max = 0;
+    test_heap_kept = 0;
+    size_t allocs_best = static_cast<size_t>(-1);
+#endif
+#if TEST_DTLB
+    uint64_t dtlb_best = static_cast<uint64_t>(-1);
 #endif
 
     for (size_t runs = 0; runs < TEST_RUNS; runs++) {
@@ -209,6 +394,12 @@ void test_case(const std::string &name, F test) {
 #if TEST_INSTRUCTIONS
         test_cycle_duration = 0;
 #endif
+#if TEST_HEAP
+        test_heap_allocs_duration = 0;
+#endif
+#if TEST_DTLB
+        test_dtlb_duration = 0;
+#endif
 
         test();
 
@@ -221,6 +412,16 @@ void test_case(const std::string &name, F test) {
         if (test_cycle_duration < cycle_best) {
             cycle_best = test_cycle_duration;
         }
+#endif
+#if TEST_HEAP
+        if (test_heap_allocs_duration < allocs_best) {
+            allocs_best = test_heap_allocs_duration;
+        }
+#endif
+#if TEST_DTLB
+        if (test_dtlb_duration < dtlb_best) {
+            dtlb_best = test_dtlb_duration;
+        }
 #endif
     }
 
@@ -233,11 +434,84 @@ void test_case(const std::string &name, F test) {
 #endif
 #if TEST_HEAP
     std::cout << test_unitfy(test_heap_max, "B") << " "; 
+    std::cout << test_unitfy(allocs_best, " allocs") << " ";
+    if (test_heap_kept) {
+        std::cout << test_unitfy(test_heap_kept, "B") << " kept ";
+    }
+#endif
+#if TEST_DTLB
+    if (test_dtlb_fd >= 0) {
+        std::cout << test_unitfy(dtlb_best, " dTLB") << " ";
+    }
 #endif
     std::cout << std::endl;
 }
 
 
+// Sets only hold keys, tests go through these to treat a set like a
+// map where every key is its own value
+template <typename M, typename=void>
+struct test_isset : std::true_type {};
+
+template <typename M>
+struct test_isset<M, decltype(void((*std::declval<M&>().begin()).first))>
+    : std::false_type {};
+
+template <typename M, typename K, typename V>
+void test_put(M &map, const K &k, const V &v, std::false_type) {
+    map[k] = v;
+}
+
+template <typename M, typename K, typename V>
+void test_put(M &map, const K &k, const V &, std::true_type) {
+    map.insert(k);
+}
+
+template <typename M, typename K, typename V>
+void test_put(M &map, const K &k, const V &v) {
+    test_put(map, k, v, test_isset<M>());
+}
+
+template <typename K, typename V>
+const K &test_key(const std::pair<K, V> &p) {
+    return p.first;
+}
+
+template <typename K>
+const K &test_key(const K &k) {
+    return k;
+}
+
+template <typename K, typename V>
+const V &test_value(const std::pair<K, V> &p) {
+    return p.second;
+}
+
+template <typename K>
+const K &test_value(const K &k) {
+    return k;
+}
+
+// what maps are built from, pairs for maps and keys for sets
+template <typename M, bool=test_isset<M>::value>
+struct test_entry {
+    typedef std::pair<unsigned, unsigned> type;
+
+    static type make(unsigned k, unsigned v) {
+        return type(k, v);
+    }
+};
+
+template <typename M>
+struct test_entry<M, true> {
+    typedef unsigned type;
+
+    static type make(unsigned k, unsigned) {
+        return k;
+    }
+};
+
+
 // Test cases
 template <template <typename ...> class M>
 void lookups_test() {
@@ -245,7 +519,37 @@ void lookups_test() {
     test_random rand(0, test_size);
     for (size_t i = 0; i < test_size; i++) {
         unsigned r = rand();
-        map[r] = r;
+        test_put(map, r, r);
+    }
+
+    test_start();
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        auto f = map.find(r);
+        if (f != map.end()) {
+            assert(test_value(*f) == r);
+        }
+    }
+    test_stop();
+}
+
+struct test_record {
+    unsigned data[16];
+};
+
+// records are told apart by their first word
+inline bool operator==(const test_record &a, unsigned b) {
+    return a.data[0] == b;
+}
+
+template <template <typename ...> class M>
+void records_test() {
+    M<unsigned, test_record> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_record record = {{r}};
+        test_put(map, r, record);
     }
 
     test_start();
@@ -253,7 +557,7 @@ void lookups_test() {
         unsigned r = rand();
         auto f = map.find(r);
         if (f != map.end()) {
-            assert(f->second == r);
+            assert(test_value(*f) == r);
         }
     }
     test_stop();
@@ -267,7 +571,7 @@ void insertions_test() {
     test_start();
     for (size_t i = 0; i < test_size; i++) {
         unsigned r = rand();
-        map[r] = r;
+        test_put(map, r, r);
     }
     test_stop();
 }
@@ -278,18 +582,31 @@ void pathological_test() {
 
     test_start();
     for (size_t i = 0; i < test_size; i++) {
-        map[i] = i;
+        test_put(map, i, i);
     }
     test_stop();
 }
 
+template <template <typename ...> class M>
+void latency_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_start();
+        test_put(map, r, r);
+        test_stop_worst();
+    }
+}
+
 template <template <typename ...> class M>
 void deletions_test() {
     M<unsigned, unsigned> map;
     test_random rand(0, test_size);
     for (size_t i = 0; i < test_size; i++) {
         unsigned r = rand();
-        map[r] = r;
+        test_put(map, r, r);
     }
 
     test_start();
@@ -297,34 +614,539 @@ void deletions_test() {
         unsigned r = rand();
         auto f = map.find(r);
         if (f != map.end()) {
-            assert(f->second == r);
+            assert(test_value(*f) == r);
             map.erase(f);
         }
     }
     test_stop();
 }
 
+// maps without shrink_to_fit give memory back as they erase
+template <typename M>
+auto test_shrink(M &map, int) -> decltype(map.shrink_to_fit()) {
+    map.shrink_to_fit();
+}
+
+template <typename M>
+void test_shrink(M &, long) {
+}
+
+template <template <typename ...> class M>
+void purge_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(map, r, r);
+    }
+
+    // erase all but every 16th key, what's left should only
+    // hold on to about as much heap as it needs, array-backed trees
+    // only shrink on the next insert, so they're asked to here
+    test_start();
+    for (size_t i = 0; i <= test_size; i++) {
+        if (i % 16 != 0) {
+            auto f = map.find(i);
+            if (f != map.end()) {
+                map.erase(f);
+            }
+        }
+    }
+    test_shrink(map, 0);
+    test_stop();
+
+    test_keep();
+    for (size_t i = 0; i <= test_size; i += 16) {
+        auto f = map.find(i);
+        assert(f == map.end() || test_value(*f) == i);
+    }
+}
+
+template <template <typename ...> class M>
+void sweep_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(map, r, r);
+    }
+
+    size_t kept = 0;
+    for (auto &&p : map) {
+        kept += test_key(p) % 10 == 0;
+    }
+
+    // erasing only loses the erased pair's iterator, so stepping
+    // past it first still has to visit every key
+    test_start();
+    for (auto i = map.begin(); i != map.end();) {
+        auto j = i++;
+        if (test_key(*j) % 10 != 0) {
+            map.erase(j);
+        }
+    }
+    test_stop();
+
+    assert(map.size() == kept);
+    for (auto &&p : map) {
+        assert(test_key(p) % 10 == 0);
+    }
+}
+
+template <template <typename ...> class M>
+void teardown_test() {
+    M<unsigned, unsigned> *map = new M<unsigned, unsigned>;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(*map, r, r);
+    }
+
+    test_start();
+    delete map;
+    test_stop();
+}
+
+template <template <typename ...> class M>
+void small_test() {
+    // lots of maps that each only hold a few dozen pairs
+    size_t count = (test_size + 31) / 32;
+    test_random rand(0, test_size);
+
+    test_start();
+    std::vector<M<unsigned, unsigned>> maps(count);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(maps[i % count], r, r);
+    }
+    test_stop();
+
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        auto f = maps[i % count].find(r);
+        assert(f == maps[i % count].end() || test_value(*f) == r);
+    }
+}
+
+// maps with reverse iterators walk the same pairs backwards, and
+// rend's base is begin, even when there's nothing in the map
+template <typename M>
+auto test_rwalk(M &map, int) -> decltype(map.rend().base(), size_t()) {
+    M empty;
+    assert(empty.rend().base() == empty.begin());
+    assert(map.rend().base() == map.begin());
+
+    size_t count = 0;
+    for (auto i = map.rbegin(); i != map.rend(); ++i) {
+        assert(test_key(*i) == test_value(*i));
+        count += 1;
+    }
+    return count;
+}
+
+template <typename M>
+size_t test_rwalk(M &map, long) {
+    return map.size();
+}
+
 template <template <typename ...> class M>
 void iteration_test() {
     M<unsigned, unsigned> map;
     test_random rand(0, test_size);
     for (size_t i = 0; i < test_size; i++) {
         unsigned r = rand();
-        map[r] = r;
+        test_put(map, r, r);
     }
 
     size_t count = 0;
 
     test_start();
-    for (auto &p : map) {
-        assert(p.first == p.second);
+    for (auto &&p : map) {
+        assert(test_key(p) == test_value(p));
         count += 1;
     }
     test_stop();
 
     assert(map.size() == count);
+    assert(test_rwalk(map, 0) == count);
+}
+
+// maps without ordered seeks have to look up every key in the range
+template <typename M>
+auto test_range(M &map, unsigned lo, unsigned hi, int)
+        -> decltype(map.lower_bound(lo), size_t()) {
+    size_t count = 0;
+    auto end = map.upper_bound(hi);
+    for (auto i = map.lower_bound(lo); i != end; ++i) {
+        assert(test_key(*i) >= lo && test_key(*i) <= hi);
+        count += 1;
+    }
+    return count;
+}
+
+template <typename M>
+size_t test_range(M &map, unsigned lo, unsigned hi, long) {
+    size_t count = 0;
+    for (unsigned k = lo; k <= hi; k++) {
+        if (map.find(k) != map.end()) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+template <template <typename ...> class M>
+void range_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(map, r, r);
+    }
+
+    size_t count = 0;
+
+    test_start();
+    for (size_t i = 0; i < test_size/64; i++) {
+        unsigned r = rand();
+        count += test_range(map, r, r + 63, 0);
+    }
+    test_stop();
+
+    assert(count <= test_size);
+}
+
+// maps without order statistics have to count through the map
+template <typename M>
+auto test_rank(M &map, unsigned k, size_t i, int)
+        -> decltype(map.rank(k), size_t()) {
+    size_t r = map.rank(k);
+    auto s = map.select(i);
+    assert(map.rank(test_key(*s)) == i);
+    return r + test_value(*s);
+}
+
+template <typename M>
+size_t test_rank(M &map, unsigned k, size_t i, long) {
+    size_t r = 0;
+    for (auto &&p : map) {
+        r += test_key(p) < k;
+    }
+
+    auto s = map.begin();
+    for (size_t j = 0; j < i; j++) {
+        ++s;
+    }
+    return r + test_value(*s);
+}
+
+template <template <typename ...> class M>
+void rank_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(map, r, r);
+    }
+
+    size_t sum = 0;
+
+    test_start();
+    for (size_t i = 0; i < test_size/64; i++) {
+        unsigned r = rand();
+        sum += test_rank(map, r, r % map.size(), 0);
+    }
+    test_stop();
+
+    assert(test_size < 64 || sum > 0);
+}
+
+// a view into someone else's buffer, like the slices
+// lookups get handed from network buffers
+struct test_slice {
+    const char *data;
+    size_t size;
+
+    operator std::string() const {
+        return std::string(data, size);
+    }
+};
+
+// compares strings with slices directly, so lookups
+// don't need to build a temporary std::string
+struct test_less {
+    typedef void is_transparent;
+
+    bool operator()(const std::string &a, const std::string &b) const {
+        return a < b;
+    }
+
+    bool operator()(const std::string &a, const test_slice &b) const {
+        return a.compare(0, a.size(), b.data, b.size) < 0;
+    }
+
+    bool operator()(const test_slice &a, const std::string &b) const {
+        return b.compare(0, b.size(), a.data, a.size) > 0;
+    }
+};
+
+template <template <typename ...> class M>
+struct test_strings {
+    typedef M<std::string, unsigned, test_less> type;
+};
+
+template <>
+struct test_strings<std::unordered_map> {
+    typedef std::unordered_map<std::string, unsigned> type;
+};
+
+template <template <typename ...> class M>
+void strings_test() {
+    typename test_strings<M>::type map;
+    test_random rand(0, test_size);
+
+    // long enough to not fit in std::string's inline buffer
+    std::vector<char> keys(test_size*32);
+    for (size_t i = 0; i < test_size; i++) {
+        snprintf(&keys[i*32], 32, "%024u", rand());
+        test_put(map, &keys[i*32], i);
+    }
+
+    test_start();
+    for (size_t i = 0; i < test_size; i++) {
+        test_slice k = {&keys[rand()%test_size * 32], 24};
+        auto f = map.find(k);
+        assert(f != map.end());
+        assert(!memcmp(test_key(*f).data(), k.data, k.size));
+    }
+    test_stop();
+}
+
+template <template <typename ...> class M>
+void bulk_test() {
+    typedef test_entry<M<unsigned, unsigned>> entry;
+    std::vector<typename entry::type> pairs;
+    for (size_t i = 0; i < test_size; i++) {
+        pairs.push_back(entry::make(2*i, 2*i));
+    }
+
+    test_start();
+    M<unsigned, unsigned> map(pairs.begin(), pairs.end());
+    test_stop();
+
+    assert(map.size() == test_size);
+    test_random rand(0, 2*test_size-1);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        auto f = map.find(r);
+        assert((f != map.end()) == !(r & 1));
+    }
+}
+
+template <typename M>
+void test_reopened(M &map) {
+    test_random rand(0, 2*test_size-1);
+    for (size_t i = 0; i < test_size/64; i++) {
+        unsigned r = rand();
+        auto f = map.find(r);
+        assert((f != map.end()) == !(r & 1));
+    }
+}
+
+// maps that can't be opened from a file have to be rebuilt
+template <typename M, typename P>
+auto test_reopen(const char *path, const P &pairs, int)
+        -> decltype(M(path).sync()) {
+    {
+        M map(path);
+        map.assign(pairs.begin(), pairs.end());
+        map.sync();
+    }
+
+    test_start();
+    M map(path);
+    test_reopened(map);
+    test_stop();
+
+    assert(map.is_open() && map.size() == test_size);
+    std::remove(path);
+}
+
+template <typename M, typename P>
+void test_reopen(const char *, const P &pairs, long) {
+    test_start();
+    M map(pairs.begin(), pairs.end());
+    test_reopened(map);
+    test_stop();
+}
+
+// gets a map of test_size pairs back into use for a handful of
+// lookups, mapped trees only page in what the lookups touch
+template <template <typename ...> class M>
+void reopen_test() {
+    typedef test_entry<M<unsigned, unsigned>> entry;
+    std::vector<typename entry::type> pairs;
+    for (size_t i = 0; i < test_size; i++) {
+        pairs.push_back(entry::make(2*i, 2*i));
+    }
+
+    test_reopen<M<unsigned, unsigned>>("tests/reopen.tmp", pairs, 0);
 }
 
+// a stream with no seeking, like a pipe
+class test_pipebuf : public std::streambuf {
+public:
+    explicit test_pipebuf(std::string &s) {
+        setg(&s[0], &s[0], &s[0] + s.size());
+    }
+};
+
+// maps without snapshots have to read the pairs back one at a time
+template <typename M>
+auto test_snapshot(M &map, M &copy, int)
+        -> decltype(copy.load(std::cin), void()) {
+    std::stringstream buffer;
+    map.save(buffer);
+
+    test_start();
+    bool ok = copy.load(buffer);
+    test_stop();
+
+    assert(ok);
+
+    // streams that can't seek have to be taken at their word
+    std::string snap = buffer.str();
+    test_pipebuf intact(snap);
+    std::istream pipe(&intact);
+    M piped;
+    assert(piped.load(pipe) && piped.size() == map.size());
+
+    // so a damaged count runs out of stream instead of memory
+    size_t header = 8;
+    while (uint8_t(snap[header]) & 0x80) {
+        header += 1;
+    }
+    std::stringstream damaged;
+    snapshot_putheader(damaged, size_t(1) << 56);
+    damaged << snap.substr(header + 1);
+    std::string bad = damaged.str();
+    test_pipebuf truncated(bad);
+    std::istream badpipe(&truncated);
+    assert(!piped.load(badpipe) && piped.size() == 0);
+}
+
+template <typename M>
+void test_snapshot(M &map, M &copy, long) {
+    std::stringstream buffer;
+    snapshot_putheader(buffer, map.size());
+    for (auto &&p : map) {
+        snapshot_codec<unsigned>::encode(buffer, test_key(p));
+        snapshot_codec<unsigned>::encode(buffer, test_value(p));
+    }
+
+    test_start();
+    size_t n = 0;
+    bool ok = snapshot_getheader(buffer, n);
+    for (size_t i = 0; i < n; i++) {
+        unsigned k;
+        unsigned v;
+        snapshot_codec<unsigned>::decode(buffer, k);
+        snapshot_codec<unsigned>::decode(buffer, v);
+        test_put(copy, k, v);
+    }
+    test_stop();
+
+    assert(ok);
+}
+
+template <template <typename ...> class M>
+void snapshot_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(map, r, r);
+    }
+
+    M<unsigned, unsigned> copy;
+    test_snapshot(map, copy, 0);
+
+    assert(copy.size() == map.size());
+    for (auto &&p : map) {
+        assert(copy.find(test_key(p)) != copy.end());
+    }
+}
+
+// maps without apply_batch get the batch one op at a time
+template <typename M, typename U, typename E>
+auto test_apply_batch(M &map, const U &ups, const E &erases, int)
+        -> decltype(map.apply_batch(ups.begin(), ups.end(),
+            erases.begin(), erases.end())) {
+    map.apply_batch(ups.begin(), ups.end(), erases.begin(), erases.end());
+}
+
+template <typename M, typename U, typename E>
+void test_apply_batch(M &map, const U &ups, const E &erases, long) {
+    for (auto &&p : ups) {
+        test_put(map, test_key(p), test_value(p));
+    }
+
+    for (auto &&k : erases) {
+        auto f = map.find(k);
+        if (f != map.end()) {
+            map.erase(f);
+        }
+    }
+}
+
+// applies test_size mixed upserts and erases in batches of
+// test_size/N, sweeping N finds where batching starts to pay off
+template <template <typename ...> class M, size_t N>
+void batch_test() {
+    M<unsigned, unsigned> map;
+    test_random rand(0, test_size);
+    for (size_t i = 0; i < test_size; i++) {
+        unsigned r = rand();
+        test_put(map, r, r);
+    }
+
+    typedef test_entry<M<unsigned, unsigned>> entry;
+    size_t batch = std::max<size_t>(test_size/N, 1);
+    std::vector<typename entry::type> ups;
+    std::vector<unsigned> erases;
+    for (size_t i = 0; i < test_size; i += batch) {
+        ups.clear();
+        erases.clear();
+        for (size_t j = 0; j < batch; j++) {
+            unsigned r = rand();
+            if (r % 4 == 0) {
+                erases.push_back(r);
+            } else {
+                ups.push_back(entry::make(r, r));
+            }
+        }
+
+        test_start();
+        test_apply_batch(map, ups, erases, 0);
+        test_stop();
+    }
+
+    for (auto &&p : map) {
+        assert(test_key(p) == test_value(p));
+    }
+}
+
+template <template <typename ...> class M>
+void batch1_test() { batch_test<M, 1>(); }
+template <template <typename ...> class M>
+void batch4_test() { batch_test<M, 4>(); }
+template <template <typename ...> class M>
+void batch16_test() { batch_test<M, 16>(); }
+template <template <typename ...> class M>
+void batch64_test() { batch_test<M, 64>(); }
+template <template <typename ...> class M>
+void batch256_test() { batch_test<M, 256>(); }
+
 
 // Entry point to testing
 template <template <typename ...> class M>
@@ -10,13 +10,47 @@
 
 #include <functional>
 #include <new>
+#include <memory>
 #include <cstring>
+#include <cstdint>
 #include <cmath>
 #include <cassert>
+#include <ratio>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include "snapshot.hpp"
+
+// Number of levels to prefetch ahead while descending, the descendants
+// that many levels down are contiguous in the array, 0 disables
+#ifndef COMPACT_SGTREE_PREFETCH
+#define COMPACT_SGTREE_PREFETCH 3
+#endif
+
+// Number of slots moved into the new array on each insert while
+// growing incrementally
+#ifndef COMPACT_SGTREE_MIGRATE
+#define COMPACT_SGTREE_MIGRATE 256
+#endif
+
+// Batches smaller than 1/N of the tree are applied one at a time,
+// anything larger is merged with the tree and rebuilt in one pass
+#ifndef COMPACT_SGTREE_BATCH
+#define COMPACT_SGTREE_BATCH 8
+#endif
 
 template <typename K, typename V,
     typename C=std::less<K>,
-    typename A=std::ratio<1,2>>
+    typename A=std::ratio<1,2>,
+    typename W=std::false_type,
+    typename S=std::false_type,
+    typename I=std::false_type,
+    typename L=std::allocator<typename std::conditional<
+        std::is_void<V>::value, K, std::pair<const K, V>>::type>,
+    typename N=std::integral_constant<size_t, 0>,
+    typename F=std::false_type>
 class compact_sgtree;
 
 template <typename K, typename V, typename C=std::less<K>>
@@ -30,45 +64,302 @@ using compact_sgtree78 = compact_sgtree<K, V, C, std::ratio<7,8>>;
 template <typename K, typename V, typename C=std::less<K>>
 using compact_sgtree11 = compact_sgtree<K, V, C, std::ratio<1,1>>;
 
-template <typename K, typename V, typename C, typename A>
+// Keeps the weight of each subtree alongside the array so that
+// finding a scapegoat doesn't need to walk any subtrees
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>,
+    typename L=std::allocator<std::pair<const K, V>>>
+using compact_wsgtree = compact_sgtree<K, V, C, A,
+    std::true_type, std::false_type, std::false_type, L>;
+
+// Keeps keys and values in separate arrays so that searches only
+// touch keys, iterators hand out pairs of references
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>,
+    typename L=std::allocator<std::pair<const K, V>>>
+using split_sgtree = compact_sgtree<K, V, C, A,
+    std::false_type, std::true_type, std::false_type, L>;
+
+// Grows by moving slots into the larger array a few at a time instead
+// of all at once, so no single insert pays for the whole array
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>,
+    typename L=std::allocator<std::pair<const K, V>>>
+using incremental_sgtree = compact_sgtree<K, V, C, A,
+    std::false_type, std::false_type, std::true_type, L>;
+
+// Keeps an array of height H inside the tree itself, so a tree of up
+// to 2^H-1 pairs never touches the heap, only larger trees move out
+template <typename K, typename V,
+    typename C=std::less<K>,
+    size_t H=6,
+    typename L=std::allocator<std::pair<const K, V>>>
+using small_sgtree = compact_sgtree<K, V, C, std::ratio<1,2>,
+    std::false_type, std::false_type, std::false_type, L,
+    std::integral_constant<size_t, H>, std::false_type>;
+
+// Never leaves the array inside the tree, holds at most 2^H-1 pairs
+// and throws std::length_error when asked to hold more
+template <typename K, typename V,
+    typename C=std::less<K>,
+    size_t H=6,
+    typename L=std::allocator<std::pair<const K, V>>>
+using fixed_sgtree = compact_sgtree<K, V, C, std::ratio<1,2>,
+    std::false_type, std::false_type, std::false_type, L,
+    std::integral_constant<size_t, H>, std::true_type>;
+
+// Sets are trees with void values, only the keys are stored and
+// iterators hand out const references to keys
+template <typename K,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>,
+    typename L=std::allocator<K>>
+using compact_sgtree_set = compact_sgtree<K, void, C, A,
+    std::false_type, std::false_type, std::false_type, L>;
+
+template <typename K,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>,
+    typename L=std::allocator<K>>
+using compact_wsgtree_set = compact_sgtree<K, void, C, A,
+    std::true_type, std::false_type, std::false_type, L>;
+
+template <typename K,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>,
+    typename L=std::allocator<K>>
+using incremental_sgtree_set = compact_sgtree<K, void, C, A,
+    std::false_type, std::false_type, std::true_type, L>;
+
+template <typename K, typename U, typename C, typename A,
+    typename W, typename S, typename I, typename L, typename N, typename F>
 class compact_sgtree {
 private:
-    struct node {
-        uint8_t deleted;
-        uint8_t left;
-        uint8_t right;
-        std::pair<K, V> pair;
+    // a void value makes the tree a set, internally sets have empty
+    // values that are never stored
+    struct _none {};
+    typedef std::is_void<U> _set;
+    typedef typename std::conditional<_set::value, _none, U>::type V;
+
+    // sets only need the keys, so they're always split
+    typedef std::integral_constant<bool,
+        S::value || _set::value> _split;
+
+    // flags are kept out of the array in bitmaps, each group
+    // covers as many slots as there are bits in a word
+    struct flags {
+        uintptr_t deleted;
+        uintptr_t left;
+        uintptr_t right;
+    };
+
+    constexpr static size_t _bits = 8*sizeof(uintptr_t);
+
+    // slots are either stored as pairs, or split into separate arrays of
+    // keys and values so that searching doesn't pull values into cache
+    struct slots {
+        std::pair<K, V> *pairs;
+        K *keys;
+        V *values;
     };
 
+    struct arrow {
+        std::pair<const K &, V &> ref;
+        std::pair<const K &, V &> *operator->() { return &ref; }
+    };
+
+    // comparisons we know are cheap and branch-free, these can search
+    // with conditional moves instead of unpredictable branches
+    typedef std::integral_constant<bool,
+        std::is_arithmetic<K>::value && (
+            std::is_same<C, std::less<K>>::value ||
+            std::is_same<C, std::greater<K>>::value)> _cheap;
+
+    // slots that can be moved with a plain memcpy, these can grow
+    // in place with realloc instead of being copied to a new array
+    typedef std::integral_constant<bool,
+        std::is_trivially_copyable<K>::value &&
+        std::is_trivially_copyable<V>::value> _trivial;
+
+    // slots with nothing to destroy, these can be freed without
+    // visiting them first
+    typedef std::integral_constant<bool,
+        std::is_trivially_destructible<K>::value &&
+        std::is_trivially_destructible<V>::value> _disposable;
+
+    static_assert(N::value == 0 || N::value >= 3,
+        "inline arrays need a height of at least 3");
+    static_assert(!F::value || N::value > 0,
+        "fixed trees need an inline array");
+    static_assert(!F::value || !I::value,
+        "fixed trees can't grow incrementally");
+
+    // arrays up to height N can live in a buffer inside the tree, laid
+    // out as the slots, then the flags, then the weights
+    constexpr static size_t _bufcap =
+        N::value ? (size_t(1) << N::value) - 1 : 0;
+    constexpr static size_t _bufvalues = _split::value
+        ? (_bufcap*sizeof(K) + alignof(V)-1) / alignof(V) * alignof(V)
+        : 0;
+    constexpr static size_t _bufflags = ((_split::value
+        ? _bufvalues + (_set::value ? 0 : _bufcap*sizeof(V))
+        : _bufcap*sizeof(std::pair<K, V>))
+        + alignof(flags)-1) / alignof(flags) * alignof(flags);
+    constexpr static size_t _bufweights =
+        _bufflags + (_bufcap + _bits-1)/_bits * sizeof(flags);
+    constexpr static size_t _bufsize =
+        _bufweights + (W::value ? _bufcap*sizeof(size_t) : 0);
+    constexpr static size_t _bufalign =
+        alignof(std::pair<K, V>) > alignof(flags)
+            ? alignof(std::pair<K, V>) : alignof(flags);
+
     C _less;
+    L _allocator;
     constexpr static double _alpha = double(A::num)/double(A::den);
 
-    node *_array;
+    slots _array;
+    flags *_flags;
+    size_t *_weights;
+
+    // while growing, slots in [_moved, _oldcap) still live in the old
+    // arrays, _moved always covers whole groups of flags
+    slots _old;
+    flags *_oldflags;
+    size_t *_oldweights;
+    size_t _moved;
+    size_t _oldcap;
+
     size_t _size;
+    size_t _tombstones;
     size_t _height;
     size_t _capacity;
+    float _max_tombstone_ratio;
+    float _min_load_ratio;
+
+    size_t _depthlimit;
+    size_t _depthlower;
+    size_t _depthupper;
+
+    typename std::aligned_storage<
+        _bufsize ? _bufsize : 1, _bufalign>::type _buffer;
 
 public:
     compact_sgtree()
-        : _size(0)
-        , _height(3)
-        , _capacity((1 << _height) - 1) {
-        _array = static_cast<node *>(malloc(_capacity*sizeof(node)));
-        new (&_array[0]) node{true, false, false, {K(), V()}};
+        : compact_sgtree(L()) {
+    }
+
+    explicit compact_sgtree(const L &allocator)
+        : _allocator(allocator)
+        , _flags(nullptr)
+        , _weights(nullptr)
+        , _moved(0)
+        , _oldcap(0)
+        , _size(0)
+        , _tombstones(0)
+        , _height(_fit(0))
+        , _capacity((size_t(1) << _height) - 1)
+        , _max_tombstone_ratio(0.5)
+        , _min_load_ratio(0.125)
+        , _depthlimit(0)
+        , _depthlower(0)
+        , _depthupper(0) {
+        _alloc(_capacity, _array, _flags, _weights);
+        _sentinel();
+    }
+
+    template <typename It>
+    compact_sgtree(It first, It last, const L &allocator=L())
+        : compact_sgtree(allocator) {
+        assign(first, last);
     }
 
     ~compact_sgtree() {
-        for (size_t i = _rawsmallest(0); i < _capacity; i = _rawsucc(i)) {
-            _array[i].pair.~pair();
+        _free();
+    }
+
+    L get_allocator() const {
+        return _allocator;
+    }
+
+    // builds a perfectly balanced tree from a range of key-value
+    // pairs, or keys for sets, sorted ranges are placed directly,
+    // anything else is sorted first, only the first of any duplicate
+    // keys is kept
+    template <typename It>
+    void assign(It first, It last) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        _assign(_input<It>(first), _input<It>(last));
+    }
+
+    // writes the pairs in order to a stream, see snapshot.hpp for
+    // the format and how to write other types
+    void save(std::ostream &out) {
+        snapshot_save<K, V>(out, size(),
+                _input<iterator>(begin()), _input<iterator>(end()));
+    }
+
+    // replaces the tree with a snapshot written by save, pairs are
+    // built into a balanced tree as they're read, so the snapshot
+    // is never held in memory, a damaged snapshot leaves the tree
+    // empty and returns false
+    bool load(std::istream &in) {
+        snapshot_reader<K, V, C> r(in, _less);
+        if (r.checked()) {
+            _checkfit(r.size());
+            _free();
+            _load(std::make_move_iterator(r.begin()), r.size());
+        } else {
+            _free();
+            _stream(r);
         }
 
-        free(_array);
+        if (!r.ok()) {
+            _free();
+            _load(std::make_move_iterator(r.begin()), 0);
+        }
+        return r.ok();
     }
 
     size_t size() const {
         return _size;
     }
 
+    size_t tombstones() const {
+        return _tombstones;
+    }
+
+    // once this fraction of slots are tombstones, the next insert or
+    // small apply_batch compacts the tree before it goes in, erase only
+    // leaves the tombstones, a ratio of 1 never compacts
+    float max_tombstone_ratio() const {
+        return _max_tombstone_ratio;
+    }
+
+    void max_tombstone_ratio(float ratio) {
+        _max_tombstone_ratio = ratio;
+    }
+
+    // once fewer than this fraction of slots hold pairs, the next
+    // insert or small apply_batch rebuilds the tree into a smaller
+    // array, erase never does, so call shrink_to_fit after a purge
+    // that isn't followed by inserts, a ratio of 0 never shrinks
+    float min_load_ratio() const {
+        return _min_load_ratio;
+    }
+
+    void min_load_ratio(float ratio) {
+        _min_load_ratio = ratio;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
 private:
     static size_t _parent(size_t i) {
         return (i+1)/2 - 1;
@@ -86,8 +377,370 @@ private:
         return ((i+1)^1)-1;
     }
 
+    static size_t _groups(size_t cap) {
+        return (cap + _bits-1) / _bits;
+    }
+
+    bool _isold(size_t i) const {
+        // both bounds in one unsigned comparison
+        return I::value && i - _moved < _oldcap - _moved;
+    }
+
+    flags &_group(size_t i) const {
+        return _isold(i) ? _oldflags[i/_bits] : _flags[i/_bits];
+    }
+
+    bool _isdeleted(size_t i) const {
+        return 1 & (_group(i).deleted >> (i%_bits));
+    }
+
+    bool _hasleft(size_t i) const {
+        return 1 & (_group(i).left >> (i%_bits));
+    }
+
+    bool _hasright(size_t i) const {
+        return 1 & (_group(i).right >> (i%_bits));
+    }
+
+    bool _haschild(size_t i, bool right) const {
+        const flags &f = _group(i);
+        return 1 & ((right ? f.right : f.left) >> (i%_bits));
+    }
+
+    static void _setbit(uintptr_t &word, size_t i, bool v) {
+        uintptr_t mask = uintptr_t(1) << (i%_bits);
+        word = v ? word | mask : word & ~mask;
+    }
+
+    void _setdeleted(size_t i, bool v) {
+        _setbit(_group(i).deleted, i, v);
+    }
+
+    void _setleft(size_t i, bool v) {
+        _setbit(_group(i).left, i, v);
+    }
+
+    void _setright(size_t i, bool v) {
+        _setbit(_group(i).right, i, v);
+    }
+
+    void _setflags(size_t i, bool deleted, bool left, bool right) {
+        _setdeleted(i, deleted);
+        _setleft(i, left);
+        _setright(i, right);
+    }
+
+    bool _inbuf(const flags *f) const {
+        return N::value && f == reinterpret_cast<const flags*>(
+                reinterpret_cast<const char*>(&_buffer) + _bufflags);
+    }
+
+    bool _bufused() const {
+        return _inbuf(_flags) || (_oldcap && _inbuf(_oldflags));
+    }
+
+    // a fixed tree can only ever hold what fits in its buffer
+    void _checkfit(size_t n) const {
+        if (F::value && n > _bufcap) {
+            throw std::length_error("compact_sgtree: fixed tree is full");
+        }
+    }
+
+    // arrays come with their flags and weights, an array that fits in
+    // the buffer goes there if nothing else is using it, the flags
+    // always start clear
+    void _alloc(size_t cap, slots &s, flags *&f, size_t *&w) {
+        s.pairs = nullptr;
+        s.keys = nullptr;
+        s.values = nullptr;
+        w = nullptr;
+
+        if (cap <= _bufcap && !_bufused()) {
+            char *b = reinterpret_cast<char*>(&_buffer);
+            if (_split::value) {
+                s.keys = reinterpret_cast<K*>(b);
+                if (!_set::value) {
+                    s.values = reinterpret_cast<V*>(b + _bufvalues);
+                }
+            } else {
+                s.pairs = reinterpret_cast<std::pair<K, V>*>(b);
+            }
+            f = reinterpret_cast<flags*>(b + _bufflags);
+            if (W::value) {
+                w = reinterpret_cast<size_t*>(b + _bufweights);
+            }
+        } else {
+            _checkfit(cap);
+            f = nullptr;
+            try {
+                if (_split::value) {
+                    s.keys = _allocate<K>(cap);
+                    if (!_set::value) {
+                        s.values = _allocate<V>(cap);
+                    }
+                } else {
+                    s.pairs = _allocate<std::pair<K, V>>(cap);
+                }
+                f = _allocate<flags>(_groups(cap));
+                if (W::value) {
+                    w = _allocate<size_t>(cap);
+                }
+            } catch (...) {
+                // hand back anything we did get, so a throw leaves
+                // nothing half allocated
+                _dealloc(cap, s, f, w);
+                throw;
+            }
+        }
+
+        memset(f, 0, _groups(cap)*sizeof(flags));
+    }
+
+    // only used for trivial slots
+    void _realloc(size_t cap, size_t ncap, slots &s, flags *&f, size_t *&w) {
+        bool from = _inbuf(f);
+        bool to = ncap <= _bufcap && (from || !_bufused());
+        if (from && to) {
+            return;
+        } else if (!from && !to) {
+            if (_split::value) {
+                s.keys = _reallocate(s.keys, cap, ncap);
+                if (!_set::value) {
+                    s.values = _reallocate(s.values, cap, ncap);
+                }
+            } else {
+                s.pairs = _reallocate(s.pairs, cap, ncap);
+            }
+            f = _reallocate(f, _groups(cap), _groups(ncap));
+            if (W::value) {
+                w = _reallocate(w, cap, ncap);
+            }
+            return;
+        }
+
+        // moving in or out of the buffer, so copy over
+        slots ns;
+        flags *nf;
+        size_t *nw;
+        _alloc(ncap, ns, nf, nw);
+        _copy(ns, 0, s, 0, std::min(cap, ncap));
+        memcpy(nf, f, std::min(_groups(cap), _groups(ncap))*sizeof(flags));
+        if (W::value) {
+            memcpy(nw, w, std::min(cap, ncap)*sizeof(size_t));
+        }
+
+        _dealloc(cap, s, f, w);
+        s = ns;
+        f = nf;
+        w = nw;
+    }
+
+    void _dealloc(size_t cap, slots &s, flags *&f, size_t *&w) {
+        if (!_inbuf(f)) {
+            _deallocate(s.pairs, cap);
+            _deallocate(s.keys, cap);
+            _deallocate(s.values, cap);
+            _deallocate(f, _groups(cap));
+            _deallocate(w, cap);
+        }
+
+        s.pairs = nullptr;
+        s.keys = nullptr;
+        s.values = nullptr;
+        f = nullptr;
+        w = nullptr;
+    }
+
+    // the default allocator is mapped straight onto malloc, so that
+    // trivial slots can still grow in place with realloc
+    typedef std::is_same<
+        typename std::allocator_traits<L>::template rebind_alloc<char>,
+        std::allocator<char>> _malloc;
+
+    template <typename T>
+    T *_allocate(size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        if (_malloc::value) {
+            T *p = static_cast<T*>(malloc(n*sizeof(T)));
+            if (!p && n > 0) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        TL a(_allocator);
+        return std::allocator_traits<TL>::allocate(a, n);
+    }
+
+    template <typename T>
+    void _deallocate(T *p, size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        if (_malloc::value) {
+            free(p);
+        } else if (p) {
+            TL a(_allocator);
+            std::allocator_traits<TL>::deallocate(a, p, n);
+        }
+    }
+
+    template <typename T>
+    T *_reallocate(T *p, size_t n, size_t nn) {
+        if (_malloc::value) {
+            // on failure the old block is still ours and still holds
+            // everything, so throw before losing track of it
+            T *np = static_cast<T*>(
+                    realloc(static_cast<void*>(p), nn*sizeof(T)));
+            if (!np && nn > 0) {
+                throw std::bad_alloc();
+            }
+            return np;
+        }
+
+        // only used for trivial slots, so a plain copy is enough
+        T *np = _allocate<T>(nn);
+        memcpy(static_cast<void*>(np), p, std::min(n, nn)*sizeof(T));
+        _deallocate(p, n);
+        return np;
+    }
+
+    slots &_slots(size_t i) {
+        return _isold(i) ? _old : _array;
+    }
+
+    size_t &_weight(size_t i) {
+        return _isold(i) ? _oldweights[i] : _weights[i];
+    }
+
+    K &_key(size_t i) {
+        return _split::value ? _slots(i).keys[i] : _slots(i).pairs[i].first;
+    }
+
+    V &_value(size_t i) {
+        return _value(i, _set());
+    }
+
+    V &_value(size_t i, std::false_type) {
+        return _split::value ? _slots(i).values[i] : _slots(i).pairs[i].second;
+    }
+
+    V &_value(size_t, std::true_type) {
+        // sets have nowhere to keep values, but they're all the same
+        static V none;
+        return none;
+    }
+
+    template <typename KK, typename... Args>
+    static void _construct(slots &s, size_t i, KK &&k, Args &&...args) {
+        if (_split::value) {
+            new (&s.keys[i]) K(std::forward<KK>(k));
+            if (!_set::value) {
+                new (&s.values[i]) V(std::forward<Args>(args)...);
+            }
+        } else {
+            new (&s.pairs[i]) std::pair<K, V>(std::piecewise_construct,
+                    std::forward_as_tuple(std::forward<KK>(k)),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+    }
+
+    static void _destroy(slots &s, size_t i, bool deleted=false) {
+        // tombstones only keep their key around for searching,
+        // their value is destroyed as soon as they are erased
+        if (_split::value) {
+            s.keys[i].~K();
+            if (!deleted && !_set::value) {
+                s.values[i].~V();
+            }
+        } else if (deleted) {
+            s.pairs[i].first.~K();
+        } else {
+            s.pairs[i].~pair();
+        }
+    }
+
+    // copies a run of n trivial slots
+    static void _copy(slots &d, size_t di, slots &s, size_t si, size_t n) {
+        if (_split::value) {
+            memcpy(static_cast<void*>(&d.keys[di]), &s.keys[si],
+                    n*sizeof(K));
+            if (!_set::value) {
+                memcpy(static_cast<void*>(&d.values[di]), &s.values[si],
+                        n*sizeof(V));
+            }
+        } else {
+            memcpy(static_cast<void*>(&d.pairs[di]), &s.pairs[si],
+                    n*sizeof(std::pair<K, V>));
+        }
+    }
+
+    // moves a slot into another array, leaving the old slot destroyed
+    static void _move(slots &d, size_t di, slots &s, size_t si) {
+        if (_split::value) {
+            new (&d.keys[di]) K(std::move(s.keys[si]));
+            if (!_set::value) {
+                new (&d.values[di]) V(std::move(s.values[si]));
+            }
+        } else {
+            new (&d.pairs[di]) std::pair<K, V>(std::move(s.pairs[si]));
+        }
+        _destroy(s, si);
+    }
+
+    void _relocate(slots &d, size_t di, size_t si) {
+        if (_trivial::value) {
+            _copy(d, di, _slots(si), si, 1);
+            return;
+        }
+
+        _move(d, di, _slots(si), si);
+    }
+
+    std::pair<K, V> &_ref(size_t i, std::false_type) {
+        return _slots(i).pairs[i];
+    }
+
+    std::pair<const K &, V &> _ref(size_t i, std::true_type) {
+        return {_slots(i).keys[i], _slots(i).values[i]};
+    }
+
+    std::pair<K, V> *_arrow(size_t i, std::false_type) {
+        return &_slots(i).pairs[i];
+    }
+
+    arrow _arrow(size_t i, std::true_type) {
+        return arrow{_ref(i, std::true_type())};
+    }
+
+    const K &_ref(size_t i, _none) {
+        return _slots(i).keys[i];
+    }
+
+    const K *_arrow(size_t i, _none) {
+        return &_slots(i).keys[i];
+    }
+
+    void _prefetch(size_t i) {
+#if COMPACT_SGTREE_PREFETCH > 0
+        // descendants a few levels down sit next to each other, so we
+        // can start fetching them long before we know which one we need
+        size_t lo = ((i+1) << COMPACT_SGTREE_PREFETCH) - 1;
+        size_t hi = lo + (size_t(1) << COMPACT_SGTREE_PREFETCH);
+        if (hi > _capacity) {
+            return;
+        }
+
+        size_t step = 64 / (_split::value
+                ? sizeof(K) : sizeof(std::pair<K, V>));
+        for (size_t j = lo; j < hi; j += step ? step : 1) {
+            __builtin_prefetch(&_key(j));
+        }
+        __builtin_prefetch(&_key(hi-1));
+        __builtin_prefetch(&_group(lo));
+#endif
+    }
+
     size_t _rawsmallest(size_t i) {
-        while (_array[i].left) {
+        while (_hasleft(i)) {
             i = _left(i);
         }
         return i;
@@ -102,14 +755,14 @@ private:
 
     size_t _smallest(size_t i) {
         i = _rawsmallest(i);
-        while (i < _capacity && _array[i].deleted) {
+        while (i < _capacity && _isdeleted(i)) {
             i = _rawsucc(i);
         }
         return i;
     }
 
     size_t _rawlargest(size_t i) {
-        while (_array[i].right) {
+        while (_hasright(i)) {
             i = _right(i);
         }
         return i;
@@ -124,14 +777,14 @@ private:
 
     size_t _largest(size_t i) {
         i = _rawlargest(i);
-        while (i < _capacity && _array[i].deleted) {
-            i = _rawlargest(i);
+        while (i < _capacity && _isdeleted(i)) {
+            i = _rawpred(i);
         }
         return i;
     }
 
     size_t _rawsucc(size_t i) {
-        if (_array[i].right) {
+        if (_hasright(i)) {
             return _rawsmallest(_right(i));
         } else {
             size_t p = _parent(i);
@@ -156,16 +809,38 @@ private:
         }
     }
 
+    // in-order rank of slot i in the pure shape of n slots, which is a
+    // complete tree, so it's the rank i would have in the perfect tree
+    // less the missing leaves that would have come before it
+    static size_t _purerank(size_t n, size_t i) {
+        size_t depth = 0;
+        while ((size_t(2) << depth) <= n) {
+            depth += 1;
+        }
+
+        size_t x = i + 1;
+        size_t d = 0;
+        while ((size_t(2) << d) <= x) {
+            d += 1;
+        }
+
+        size_t rank = (2*(x - (size_t(1) << d)) + 1)
+                * (size_t(1) << (depth-d)) - 1;
+        size_t leaves = n - ((size_t(1) << depth) - 1);
+        size_t before = (rank + 1)/2;
+        return before > leaves ? rank - (before - leaves) : rank;
+    }
+
     size_t _succ(size_t i) {
         i = _rawsucc(i);
-        while (i < _capacity && _array[i].deleted) {
+        while (i < _capacity && _isdeleted(i)) {
             i = _rawsucc(i);
         }
         return i;
     }
 
     size_t _rawpred(size_t i) {
-        if (_array[i].left) {
+        if (_hasleft(i)) {
             return _rawlargest(_left(i));
         } else {
             size_t p = _parent(i);
@@ -192,14 +867,32 @@ private:
 
     size_t _pred(size_t i) {
         i = _rawpred(i);
-        while (i < _capacity && _array[i].deleted) {
+        while (i < _capacity && _isdeleted(i)) {
             i = _rawpred(i);
         }
         return i;
     }
 
+    // how iterators see slots, sets only hand out keys
+    typedef typename std::conditional<_set::value, _none, S>::type _view;
+
 public:
+    typedef typename std::conditional<_set::value,
+        K,
+        std::pair<K, V>>::type value_type;
+    typedef typename std::conditional<_set::value,
+        const K &,
+        typename std::conditional<S::value,
+            std::pair<const K &, V &>,
+            std::pair<K, V> &>::type>::type reference;
+    typedef typename std::conditional<_set::value,
+        const K *,
+        typename std::conditional<S::value,
+            arrow,
+            std::pair<K, V> *>::type>::type pointer;
+
     class iterator;
+    class reverse_iterator;
 
     iterator begin() {
         return iterator(this, _smallest(0));
@@ -209,124 +902,651 @@ public:
         return iterator(this, -1);
     }
 
+    reverse_iterator rbegin() {
+        return reverse_iterator(this, _largest(0));
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(this, -1);
+    }
+
 private:
     void _expand() {
-        size_t nheight = _height + 1;
-        size_t ncapacity = (1 << _height) - 1;
-        node *narray = static_cast<node*>(malloc(ncapacity*sizeof(node)));
+        if (_trivial::value) {
+            // adding a level keeps every index valid, so the array can
+            // grow in place and be rebuilt without a second copy
+            _extend();
+            compact();
+            return;
+        }
+
+        _resize(_height + 1);
+    }
+
+    // rebuilds the tree into a new array of the given height in one
+    // pass, the array can be smaller as long as the pairs still fit
+    void _resize(size_t nheight) {
+        _migrate(_oldcap);
+
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        if (_trivial::value && nheight < _height) {
+            // compacting leaves the pairs in the first size slots, so
+            // trivial slots can shrink in place without being copied
+            compact();
+            _realloc(_capacity, ncapacity, _array, _flags, _weights);
+
+            // growing assumes flags past the end are clear
+            uintptr_t mask = (uintptr_t(1) << (ncapacity%_bits)) - 1;
+            _flags[ncapacity/_bits].deleted &= mask;
+            _flags[ncapacity/_bits].left &= mask;
+            _flags[ncapacity/_bits].right &= mask;
+
+            _height = nheight;
+            _capacity = ncapacity;
+            return;
+        }
+
+        slots narray;
+        flags *nflags;
+        size_t *nweights;
+        _alloc(ncapacity, narray, nflags, nweights);
 
         size_t bi = _puresmallest(_size, 0);
         for (size_t i = _rawsmallest(0); i < _capacity; i = _rawsucc(i)) {
-            if (_array[i].deleted) {
-                _array[i].pair.~pair();
+            if (_isdeleted(i)) {
+                _destroy(_slots(i), i, true);
                 continue;
             }
 
-            new (&narray[bi]) node{
-                false,
-                _left(bi) < _size,
-                _right(bi) < _size,
-                std::move(_array[i].pair)};
-            _array[i].pair.~pair();
+            _relocate(narray, bi, i);
+            _setbit(nflags[bi/_bits].left, bi, _left(bi) < _size);
+            _setbit(nflags[bi/_bits].right, bi, _right(bi) < _size);
             bi = _puresucc(_size, bi);
         }
 
-        free(_array);
+        _dealloc(_capacity, _array, _flags, _weights);
         _array = narray;
+        _flags = nflags;
+        _weights = nweights;
+        _tombstones = 0;
+        _height = nheight;
+        _capacity = ncapacity;
+
+        if (W::value) {
+            _reweigh(0, _size);
+        }
+
+        if (_size == 0) {
+            _sentinel();
+        }
+    }
+
+    void _extend() {
+        size_t nheight = _height + 1;
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        _realloc(_capacity, ncapacity, _array, _flags, _weights);
+        memset(&_flags[_groups(_capacity)], 0,
+                (_groups(ncapacity) - _groups(_capacity))*sizeof(flags));
+
         _height = nheight;
         _capacity = ncapacity;
     }
 
-    static size_t _bound(size_t root, size_t size) {
-        return size + root*(size_t(1) << int(log2(size)));
+    void _grow() {
+        // slots keep their index in a larger array, so the tree is still
+        // valid while it is only partially moved over
+        _migrate(_oldcap);
+
+        _old = _array;
+        _oldflags = _flags;
+        _oldweights = _weights;
+        _oldcap = _capacity;
+        _moved = 0;
+
+        _height += 1;
+        _capacity = (size_t(1) << _height) - 1;
+        _alloc(_capacity, _array, _flags, _weights);
     }
 
-    void _rebalance(size_t root, size_t w, size_t h) {
-        size_t wc = _bound(root, (1 << h) - 1);
-        size_t bc = _bound(root, w);
+    void _migrate(size_t n) {
+        while (_moved < _oldcap && n > 0) {
+            size_t g = _moved/_bits;
+            size_t lo = _moved;
+            size_t hi = std::min(lo + _bits, _oldcap);
 
-        size_t wi = _purelargest(wc, root);
-        size_t ci = _rawlargest(root);
-        while (ci+1 > root) {
-            if (_array[ci].deleted) {
-                _array[ci].pair.~pair();
-                ci = _rawpred(ci);
+            // the new group may already hold flags for slots past the
+            // end of the old array
+            _flags[g].deleted |= _oldflags[g].deleted;
+            _flags[g].left |= _oldflags[g].left;
+            _flags[g].right |= _oldflags[g].right;
+            _moved = hi;
+
+            if (_trivial::value) {
+                // trivial slots can be copied a group at a time, slots
+                // that aren't in the tree are just copied along
+                _copy(_array, lo, _old, lo, hi - lo);
+                if (W::value) {
+                    memcpy(&_weights[lo], &_oldweights[lo],
+                            (hi - lo)*sizeof(size_t));
+                }
+
+                n -= std::min(n, hi - lo);
                 continue;
             }
 
-            if (wi != ci) {
-                new (&_array[wi].pair) std::pair<K, V>{
-                    std::move(_array[ci].pair)};
-                _array[ci].pair.~pair();
-            }
+            for (size_t i = lo; i < hi; i++) {
+                if (i > 0 && !_haschild(_parent(i), i == _right(_parent(i)))) {
+                    continue;
+                }
 
-            _array[wi].deleted = 2;
-            wi = _purepred(wc, wi);
-            ci = _rawpred(ci);
-        }
+                if (_isdeleted(i)) {
+                    new (&_key(i)) K(std::move(_split::value
+                            ? _old.keys[i] : _old.pairs[i].first));
+                    _destroy(_old, i, true);
+                } else {
+                    _move(_array, i, _old, i);
+                }
 
-        size_t bi = _puresmallest(bc, root);
-        wi = _puresucc(wc, wi);
-        while (wi+1 > root) {
-            if (bi != wi) {
-                new (&_array[bi]) node{
-                    false,
-                    _left(bi) < bc,
-                    _right(bi) < bc,
-                    std::move(_array[wi].pair)};
-                _array[wi].pair.~pair();
+                if (W::value) {
+                    _weights[i] = _oldweights[i];
+                }
             }
 
-            bi = _puresucc(bc, bi);
-            wi = _puresucc(wc, wi);
+            n -= std::min(n, hi - lo);
+        }
+
+        if (_oldcap && _moved >= _oldcap) {
+            _dealloc(_oldcap, _old, _oldflags, _oldweights);
+            _moved = 0;
+            _oldcap = 0;
+        }
+    }
+
+    // destroys and frees a scratch array of pairs
+    void _release(std::pair<K, V> *p, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            p[j].~pair();
+        }
+        _deallocate(p, n);
+    }
+
+    // and the merged run, upserts, and erases apply_batch builds
+    void _release(std::pair<K, V> *ms, size_t m, size_t nm,
+            std::pair<K, V> *us, size_t nu, K *es, size_t ne) {
+        for (size_t j = 0; j < m; j++) {
+            ms[j].~pair();
+        }
+        _deallocate(ms, nm);
+        _release(us, nu);
+        for (size_t j = 0; j < ne; j++) {
+            es[j].~K();
+        }
+        _deallocate(es, ne);
+    }
+
+    // leaves the tree without an array, only _load or the destructor
+    // should follow, but if _load throws the destructor still works
+    void _free() {
+        if (!_disposable::value && _flags) {
+            for (size_t i = _rawsmallest(0); i < _capacity;
+                    i = _rawsucc(i)) {
+                _destroy(_slots(i), i, _isdeleted(i));
+            }
+        }
+
+        if (_oldcap) {
+            _dealloc(_oldcap, _old, _oldflags, _oldweights);
+            _moved = 0;
+            _oldcap = 0;
+        }
+
+        _dealloc(_capacity, _array, _flags, _weights);
+        _height = 0;
+        _capacity = 0;
+        _size = 0;
+        _tombstones = 0;
+    }
+
+    // smallest height of array that fits n pairs, arrays are never
+    // smaller than the buffer so they always fill it
+    static size_t _fit(size_t n) {
+        size_t h = N::value ? N::value : 3;
+        while ((size_t(1) << h) - 1 < n) {
+            h += 1;
+        }
+        return h;
+    }
+
+    // after a mass erase most of the array can be empty, rebuild into
+    // a smaller one with a level to spare so inserts don't immediately
+    // grow it again
+    void _contract() {
+        if (_size >= _min_load_ratio*_capacity) {
+            return;
+        }
+
+        size_t nheight = std::min(_fit(_size) + 1, _height - 1);
+        if (nheight >= _fit(_size)) {
+            _resize(nheight);
+        }
+    }
+
+    // lets a range of keys stand in for a range of pairs, so sets can
+    // share the bulk paths with maps
+    template <typename It>
+    class _keyed {
+    private:
+        It _it;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const K &, V> value_type;
+        typedef typename std::iterator_traits<It>::difference_type
+            difference_type;
+        typedef value_type *pointer;
+        typedef value_type reference;
+
+        explicit _keyed(It it)
+            : _it(it) {
+        }
+
+        reference operator*() { return reference(*_it, V()); }
+
+        friend bool operator==(const _keyed &a, const _keyed &b) {
+            return a._it == b._it;
+        }
+
+        friend bool operator!=(const _keyed &a, const _keyed &b) {
+            return a._it != b._it;
+        }
+
+        _keyed &operator++() {
+            ++_it;
+            return *this;
+        }
+    };
+
+    template <typename It>
+    using _input = typename std::conditional<_set::value,
+        _keyed<It>, It>::type;
+
+    template <typename It>
+    void _assign(It first, It last) {
+        typedef typename std::iterator_traits<It>::value_type T;
+
+        size_t n = std::distance(first, last);
+        if (std::adjacent_find(first, last, [this](const T &a, const T &b) {
+                    return !_less(a.first, b.first);
+                }) == last) {
+            _checkfit(n);
+            _free();
+            _load(first, n);
+            return;
+        }
+
+        std::pair<K, V> *temp = _allocate<std::pair<K, V>>(n);
+        size_t j = 0;
+        for (It i = first; i != last; ++i) {
+            new (&temp[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        std::stable_sort(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        size_t m = std::unique(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return !_less(a.first, b.first);
+                }) - temp;
+
+        // a fixed tree is left alone if the pairs don't fit
+        bool fits = !F::value || m <= _bufcap;
+        if (fits) {
+            _free();
+            try {
+                _load(std::make_move_iterator(temp), m);
+            } catch (...) {
+                _release(temp, n);
+                throw;
+            }
+        }
+
+        _release(temp, n);
+        _checkfit(m);
+    }
+
+    template <typename It>
+    void _load(It first, size_t n) {
+        // nothing changes until the arrays are ours
+        size_t height = _fit(n);
+        size_t capacity = (size_t(1) << height) - 1;
+        _alloc(capacity, _array, _flags, _weights);
+        _height = height;
+        _capacity = capacity;
+
+        // sorted input lands in order on the pure shape of n slots
+        size_t bi = _puresmallest(n, 0);
+        for (size_t i = 0; i < n; i++, ++first) {
+            _construct(_array, bi, (*first).first, (*first).second);
+            _setflags(bi, false, _left(bi) < n, _right(bi) < n);
+            bi = _puresucc(n, bi);
+        }
+
+        _size = n;
+        _tombstones = 0;
+
+        if (W::value) {
+            _reweigh(0, n);
+        }
+
+        if (n == 0) {
+            _sentinel();
+        }
+    }
+
+    // a count nothing vouches for only goes as far as the pairs do, so
+    // the array grows a level at a time as they arrive, filling the
+    // first slots in order, which is always the pure shape of that many
+    // slots, and the pairs only move into place once they're all here
+    template <typename R>
+    void _stream(R &r) {
+        auto it = std::make_move_iterator(r.begin());
+        _load(it, 0);
+        _destroy(_array, 0, true);
+        _setflags(0, false, false, false);
+        _tombstones = 0;
+
+        try {
+            for (; r.size() > 0 && r.ok(); ++it) {
+                if (_size == _capacity) {
+                    _widen();
+                }
+
+                _construct(_array, _size, (*it).first, (*it).second);
+                if (_size > 0) {
+                    size_t p = _parent(_size);
+                    _setflags(p, false, _left(p) <= _size, _right(p) <= _size);
+                }
+                _size += 1;
+            }
+        } catch (...) {
+            // the pairs aren't in place yet, so don't leave them, but
+            // _free expects an empty tree to still have its sentinel
+            if (_size == 0) {
+                _sentinel();
+            }
+            _free();
+            _load(it, 0);
+            throw;
+        }
+
+        if (_size == 0) {
+            _sentinel();
+            return;
+        } else if (!r.ok()) {
+            return;
+        }
+
+        _arrange(_size);
+        if (W::value) {
+            _reweigh(0, _size);
+        }
+    }
+
+    // adds a level to the array without moving any slot
+    void _widen() {
+        if (_trivial::value) {
+            _extend();
+            return;
+        }
+
+        size_t nheight = _height + 1;
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        slots narray;
+        flags *nflags;
+        size_t *nweights;
+        _alloc(ncapacity, narray, nflags, nweights);
+        for (size_t i = 0; i < _size; i++) {
+            _relocate(narray, i, i);
+        }
+        memcpy(nflags, _flags, _groups(_capacity)*sizeof(flags));
+
+        _dealloc(_capacity, _array, _flags, _weights);
+        _array = narray;
+        _flags = nflags;
+        _weights = nweights;
+        _height = nheight;
+        _capacity = ncapacity;
+    }
+
+    // moves n pairs sorted into the first n slots onto the pure shape
+    // of n slots, each cycle of the permutation is followed once, with
+    // the deleted flags marking slots that already hold their pair
+    void _arrange(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (_isdeleted(i) || _purerank(n, i) == i) {
+                continue;
+            }
+
+            std::pair<K, V> t(std::move(_key(i)), std::move(_value(i)));
+            _destroy(_array, i);
+            size_t j = i;
+            while (true) {
+                size_t r = _purerank(n, j);
+                _setdeleted(j, true);
+                if (r == i) {
+                    break;
+                }
+
+                _relocate(_array, j, r);
+                j = r;
+            }
+            _construct(_array, j, std::move(t.first), std::move(t.second));
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            _setflags(i, false, _left(i) < n, _right(i) < n);
+        }
+    }
+
+    void _sentinel() {
+        // an empty tree still needs a root to search from
+        new (&_key(0)) K();
+        _setflags(0, true, false, false);
+        _tombstones += 1;
+
+        if (W::value) {
+            _weight(0) = 0;
+        }
+    }
+
+    static size_t _bound(size_t root, size_t size) {
+        if (size == 0) {
+            return 0;
+        }
+
+        return size + root*(size_t(1) << int(log2(size)));
+    }
+
+    void _rebalance(size_t root, size_t w) {
+        _rebalance(root, w, static_cast<const K*>(nullptr));
+    }
+
+    // given a key, the subtree is rebuilt with an extra empty slot where
+    // the key belongs, which is returned
+    template <typename Q>
+    size_t _rebalance(size_t root, size_t w, const Q *k) {
+        size_t h = 0;
+        for (size_t i = root; i < _capacity; i = _left(i)) {
+            h += 1;
+        }
+
+        size_t wc = _bound(root, (size_t(1) << h) - 1);
+        size_t bc = _bound(root, k ? w+1 : w);
+
+        size_t wi = _purelargest(wc, root);
+        size_t ci = _rawlargest(root);
+        while (ci+1 > root) {
+            if (_isdeleted(ci)) {
+                _destroy(_slots(ci), ci, true);
+                _tombstones -= 1;
+                ci = _rawpred(ci);
+                continue;
+            }
+
+            if (wi != ci) {
+                _relocate(_slots(wi), wi, ci);
+            }
+
+            _setdeleted(wi, true);
+            wi = _purepred(wc, wi);
+            ci = _rawpred(ci);
+        }
+
+        // the gap lands before the slot it's taken from is read, so it
+        // never overwrites a pair that hasn't moved yet
+        size_t gap = -1;
+        size_t bi = _puresmallest(bc, root);
+        wi = _puresucc(wc, wi);
+        while (wi+1 > root) {
+            if (k && gap == size_t(-1) && _less(*k, _key(wi))) {
+                gap = bi;
+                _setflags(bi, true, _left(bi) < bc, _right(bi) < bc);
+                bi = _puresucc(bc, bi);
+                continue;
+            }
+
+            if (bi != wi) {
+                _relocate(_slots(bi), bi, wi);
+            }
+
+            _setflags(bi, false, _left(bi) < bc, _right(bi) < bc);
+
+            bi = _puresucc(bc, bi);
+            wi = _puresucc(wc, wi);
+        }
+
+        if (k && gap == size_t(-1)) {
+            gap = bi;
+            _setflags(bi, true, _left(bi) < bc, _right(bi) < bc);
+        }
+
+        if (W::value) {
+            _reweigh(root, bc);
+        }
+
+        return gap;
+    }
+
+    void _reweigh(size_t root, size_t cap) {
+        // every slot below cap is live after a rebuild, weigh each
+        // level bottom-up so children are weighed before their parents
+        size_t lo = root;
+        size_t hi = root;
+        while (lo < cap) {
+            lo = _left(lo);
+            hi = _right(hi);
+        }
+
+        while (lo != root) {
+            lo = _parent(lo);
+            hi = _parent(hi);
+            for (size_t i = lo; i <= hi && i < cap; i++) {
+                _weight(i) = 1
+                    + (_left(i) < cap ? _weight(_left(i)) : 0)
+                    + (_right(i) < cap ? _weight(_right(i)) : 0);
+            }
+        }
+    }
+
+    void _propagate(size_t i, ssize_t d) {
+        while (i < _capacity) {
+            _weight(i) += d;
+            i = _parent(i);
         }
     }
 
     size_t _weigh(size_t root) {
+        if (W::value) {
+            return _weight(root);
+        }
+
         size_t w = 0;
-        for (size_t i = _smallest(root); i+1 > root; i = _succ(i)) {
-            w += 1;
+        for (size_t i = _rawsmallest(root); i+1 > root; i = _rawsucc(i)) {
+            w += !_isdeleted(i);
         }
         return w;
     }
 
-    std::tuple<size_t, size_t, size_t> _scapegoat(size_t i) {
+    size_t _maxdepth() {
+        // log(size)/log(1/alpha) rounded down, only recomputed when
+        // the size leaves [_depthlower, _depthupper)
+        if (A::num >= A::den) {
+            return size_t(-1) >> 1;
+        }
+
+        if (_size < _depthlower || _size >= _depthupper) {
+            constexpr double ialpha = double(A::den)/double(A::num);
+            double t = 1;
+            _depthlimit = 0;
+            while (t*ialpha <= _size) {
+                t *= ialpha;
+                _depthlimit += 1;
+            }
+
+            _depthlower = ceil(t);
+            _depthupper = ceil(t*ialpha);
+        }
+
+        return _depthlimit;
+    }
+
+    std::pair<size_t, size_t> _scapegoat(size_t i) {
+        // weights include the new element at i, but since we rebuild
+        // before inserting, only take a scapegoat if rebuilding it
+        // is sure to shorten the path to i
         size_t w = 1;
         size_t h = 1;
 
-        while (true) {
-            assert(_parent(i) < _capacity);
+        while (i > 0) {
             size_t p = _parent(i);
-            size_t pw = (_array[p].left && _array[p].right ?
-                    _weigh(_sibling(i)) : 0) + w + 1;
+            bool sibling = (i == _left(p)) ? _hasright(p) : _hasleft(p);
+            size_t pw = (sibling ? _weigh(_sibling(i)) : 0)
+                    + w + !_isdeleted(p);
+            h += 1;
 
-            if (w > _alpha * pw + 1) {
-                return std::make_tuple(p, pw, h+1);
+            if (w > _alpha * pw + 1 && size_t(log2(pw)) + 2 < h) {
+                return std::make_pair(p, pw - 1);
             }
 
             i = p;
             w = pw;
-            h += 1;
         }
+
+        // tombstones can leave the tree too deep without any
+        // unbalanced subtree, just rebuild the whole thing
+        return std::make_pair(0, w - 1);
     }
 
-public:
-    iterator find(const K &k) {
+    template <typename Q>
+    iterator _find(const Q &k, std::false_type) {
         size_t i = 0;
 
         while (true) {
-            if (_less(k, _array[i].pair.first)) {
-                if (!_array[i].left) {
+            _prefetch(i);
+
+            if (_less(k, _key(i))) {
+                if (!_hasleft(i)) {
                     return end();
                 }
                 i = _left(i);
-            } else if (_less(_array[i].pair.first, k)) {
-                if (!_array[i].right) {
+            } else if (_less(_key(i), k)) {
+                if (!_hasright(i)) {
                     return end();
                 }
                 i = _right(i);
             } else {
-                if (_array[i].deleted) {
+                if (_isdeleted(i)) {
                     return end();
                 }
                 return iterator(this, i);
@@ -334,67 +1554,542 @@ public:
         }
     }
 
-    V &operator[](const K &k) {
+    template <typename Q>
+    iterator _find(const Q &k, std::true_type) {
         size_t i = 0;
-        uint8_t *branch = nullptr;
-        size_t depth = 0;
 
         while (true) {
-            if (_less(k, _array[i].pair.first)) {
-                if (!_array[i].left) {
-                    branch = &_array[i].left;
-                    i = _left(i);
-                    break;
+            _prefetch(i);
+
+            const K &key = _key(i);
+            if (!_less(k, key) && !_less(key, k)) {
+                if (_isdeleted(i)) {
+                    return end();
                 }
+                return iterator(this, i);
+            }
+
+            bool right = _less(key, k);
+            if (!_haschild(i, right)) {
+                return end();
+            }
+            i = _left(i) + right;
+        }
+    }
+
+    template <typename Q>
+    size_t _seek(const Q &k, bool upper) {
+        // the last slot we went left at is the first key past k
+        size_t i = 0;
+        size_t b = -1;
+
+        while (true) {
+            _prefetch(i);
+
+            bool right = upper ? !_less(k, _key(i)) : _less(_key(i), k);
+            if (!right) {
+                b = i;
+            }
+
+            if (!_haschild(i, right)) {
+                break;
+            }
+            i = _left(i) + right;
+        }
+
+        // tombstones keep their place in order, so skip past them
+        if (b < _capacity && _isdeleted(b)) {
+            b = _succ(b);
+        }
+        return b;
+    }
+
+    void _erase(size_t i) {
+        _value(i).~V();
+        _setdeleted(i, true);
+        _size -= 1;
+        _tombstones += 1;
+
+        if (W::value) {
+            _propagate(i, -1);
+        }
+    }
+
+public:
+    iterator find(const K &k) {
+        return _find(k, _cheap());
+    }
+
+    // transparent comparators can look up anything comparable
+    // with K without building a temporary key
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator find(const Q &k) {
+        return _find(k, _cheap());
+    }
+
+    size_t count(const K &k) {
+        return find(k) != end();
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    size_t count(const Q &k) {
+        return find(k) != end();
+    }
+
+    iterator lower_bound(const K &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator lower_bound(const Q &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    iterator upper_bound(const K &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator upper_bound(const Q &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    std::pair<iterator, iterator> equal_range(const K &k) {
+        // keys are unique, so the range is at most one past lower_bound
+        size_t i = _seek(k, false);
+        if (i < _capacity && !_less(k, _key(i))) {
+            return std::make_pair(iterator(this, i), iterator(this, _succ(i)));
+        }
+        return std::make_pair(iterator(this, i), iterator(this, i));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    std::pair<iterator, iterator> equal_range(const Q &k) {
+        size_t i = _seek(k, false);
+        if (i < _capacity && !_less(k, _key(i))) {
+            return std::make_pair(iterator(this, i), iterator(this, _succ(i)));
+        }
+        return std::make_pair(iterator(this, i), iterator(this, i));
+    }
+
+    // order statistics, these are O(log n) when weights are kept,
+    // otherwise every subtree we skip over has to be walked
+    size_t rank(const K &k) {
+        size_t i = 0;
+        size_t r = 0;
+
+        while (true) {
+            bool right = _less(_key(i), k);
+            if (right) {
+                r += (_hasleft(i) ? _weigh(_left(i)) : 0) + !_isdeleted(i);
+            }
+
+            if (!_haschild(i, right)) {
+                return r;
+            }
+            i = _left(i) + right;
+        }
+    }
+
+    iterator select(size_t n) {
+        if (n >= _size) {
+            return end();
+        }
+
+        size_t i = 0;
+        while (true) {
+            size_t lw = _hasleft(i) ? _weigh(_left(i)) : 0;
+            if (n < lw) {
                 i = _left(i);
-                depth += 1;
-            } else if (_less(_array[i].pair.first, k)) {
-                if (!_array[i].right) {
-                    branch = &_array[i].right;
-                    i = _right(i);
-                    break;
+                continue;
+            }
+
+            n -= lw;
+            if (!_isdeleted(i)) {
+                if (n == 0) {
+                    return iterator(this, i);
                 }
-                i = _right(i);
-                depth += 1;
-            } else {
-                if (_array[i].deleted) {
-                    _array[i].deleted = false;
-                    _array[i].pair = std::pair<K, V>(k, V());
+                n -= 1;
+            }
+            i = _right(i);
+        }
+    }
+
+    // number of keys in [lo, hi)
+    size_t count(const K &lo, const K &hi) {
+        if (!_less(lo, hi)) {
+            return 0;
+        }
+
+        return rank(hi) - rank(lo);
+    }
+
+private:
+    // cleans up after erases, which leave tombstones and never move
+    // anything so that iterators stay valid
+    void _tidy() {
+        if (_tombstones == 0) {
+            return;
+        }
+
+        // contracting also clears out the tombstones
+        _contract();
+        if (_tombstones > _max_tombstone_ratio*(_size + _tombstones)) {
+            compact();
+        }
+    }
+
+    template <typename KK, typename... Args>
+    std::pair<iterator, bool> _emplace(KK &&k, Args &&...args) {
+        _tidy();
+
+        if (I::value) {
+            _migrate(COMPACT_SGTREE_MIGRATE);
+        }
+
+        size_t i = 0;
+        size_t depth = 0;
+
+        while (true) {
+            while (true) {
+                _prefetch(i);
+
+                if (_less(k, _key(i))) {
+                    if (!_hasleft(i)) {
+                        i = _left(i);
+                        break;
+                    }
+                    i = _left(i);
+                    depth += 1;
+                } else if (_less(_key(i), k)) {
+                    if (!_hasright(i)) {
+                        i = _right(i);
+                        break;
+                    }
+                    i = _right(i);
+                    depth += 1;
+                } else {
+                    if (!_isdeleted(i)) {
+                        return std::make_pair(iterator(this, i), false);
+                    }
+
+                    _setdeleted(i, false);
+                    _key(i) = std::forward<KK>(k);
+                    new (&_value(i)) V(std::forward<Args>(args)...);
                     _size += 1;
+                    _tombstones -= 1;
+
+                    if (W::value) {
+                        _propagate(i, +1);
+                    }
+                    return std::make_pair(iterator(this, i), true);
                 }
-                return _array[i].pair.second;
             }
-        }
 
-        if (_size > 0 && depth > (log(_size)/log(1.0/_alpha)) + 2) {
-            size_t sg, w, h;
-            std::tie(sg, w, h) = _scapegoat(_parent(i));
-            _rebalance(sg, w, h);
-            return operator[](k);
+            if (_size > 0 && depth > _maxdepth() + 2) {
+                std::pair<size_t, size_t> sg = _scapegoat(i);
+                _rebalance(sg.first, sg.second);
+
+                // only the scapegoat's subtree moved, so the search
+                // can pick back up from there
+                i = sg.first;
+                depth = 0;
+                for (size_t j = i; j > 0; j = _parent(j)) {
+                    depth += 1;
+                }
+                continue;
+            }
+
+            if (i >= _capacity && _inbuf(_flags)
+                    && (F::value || _size < _capacity)) {
+                // the buffer can't grow, so while it has room rebuild
+                // the whole tree with a gap where k goes
+                _checkfit(_size + 1);
+                i = _rebalance(0, _size, &k);
+                _construct(_array, i,
+                        std::forward<KK>(k), std::forward<Args>(args)...);
+                _setdeleted(i, false);
+                _size += 1;
+                return std::make_pair(iterator(this, i), true);
+            }
+
+            if (i >= _capacity) {
+                if (I::value) {
+                    // slots keep their index, i is still where k goes
+                    _grow();
+                } else {
+                    _expand();
+                    i = 0;
+                    depth = 0;
+                    continue;
+                }
+            }
+
+            break;
         }
 
-        if (i >= _capacity) {
-            _expand();
-            return operator[](k);
+        if (i == _left(_parent(i))) {
+            _setleft(_parent(i), true);
+        } else {
+            _setright(_parent(i), true);
         }
 
-        *branch = true;
-        new (&_array[i]) node{false, false, false, {k, V()}};
+        _construct(_slots(i), i,
+                std::forward<KK>(k), std::forward<Args>(args)...);
+        _setflags(i, false, false, false);
         _size += 1;
 
-        return _array[i].pair.second;
+        if (W::value) {
+            _weight(i) = 0;
+            _propagate(i, +1);
+        }
+
+        return std::make_pair(iterator(this, i), true);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> _emplacefrom(std::false_type, Args &&...args) {
+        std::pair<K, V> p(std::forward<Args>(args)...);
+        return _emplace(std::move(p.first), std::move(p.second));
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> _emplacefrom(std::true_type, Args &&...args) {
+        K k(std::forward<Args>(args)...);
+        return _emplace(std::move(k));
+    }
+
+public:
+    // maps only, a set has no values to hand out
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    V &operator[](const K &k) {
+        return _value(_emplace(k).first._i);
+    }
+
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    V &operator[](K &&k) {
+        return _value(_emplace(std::move(k)).first._i);
+    }
+
+    // sets are only given keys
+    template <typename SS=_set,
+        typename=typename std::enable_if<SS::value>::type>
+    std::pair<iterator, bool> insert(const K &k) {
+        return _emplace(k);
+    }
+
+    template <typename SS=_set,
+        typename=typename std::enable_if<SS::value>::type>
+    std::pair<iterator, bool> insert(K &&k) {
+        return _emplace(std::move(k));
+    }
+
+    // constructs a pair from args, or just the key for sets, like
+    // std::map this builds it before knowing if the key is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        return _emplacefrom(_set(), std::forward<Args>(args)...);
+    }
+
+    // only constructs the value if k isn't already in the tree
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type,
+        typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &k, Args &&...args) {
+        return _emplace(k, std::forward<Args>(args)...);
+    }
+
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type,
+        typename... Args>
+    std::pair<iterator, bool> try_emplace(K &&k, Args &&...args) {
+        return _emplace(std::move(k), std::forward<Args>(args)...);
+    }
+
+    template <typename M, typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    std::pair<iterator, bool> insert_or_assign(const K &k, M &&m) {
+        std::pair<iterator, bool> r = _emplace(k, std::forward<M>(m));
+        if (!r.second) {
+            _value(r.first._i) = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    template <typename M, typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    std::pair<iterator, bool> insert_or_assign(K &&k, M &&m) {
+        std::pair<iterator, bool> r =
+                _emplace(std::move(k), std::forward<M>(m));
+        if (!r.second) {
+            _value(r.first._i) = std::forward<M>(m);
+        }
+        return r;
     }
 
+    // erasing only invalidates iterators to the erased pair, the
+    // tombstone it leaves and any shrinking wait for the next insert,
+    // inserts, compact, shrink_to_fit, and apply_batch may move
+    // everything
     void erase(iterator p) {
-        _array[p._i].deleted = true;
-        _size -= 1;
+        _erase(p._i);
+    }
+
+    // rebuilds the tree in place without any tombstones
+    void compact() {
+        _rebalance(0, _size);
+
+        if (_size == 0) {
+            _sentinel();
+        }
+    }
+
+    // rebuilds the tree into the smallest array that fits it
+    void shrink_to_fit() {
+        if (_fit(_size) < _height) {
+            _resize(_fit(_size));
+        }
+    }
+
+    // applies a range of key-value upserts, or keys for sets, and then
+    // a range of keys to erase, later upserts of a key win and erases
+    // win over upserts
+    template <typename It, typename Jt>
+    void apply_batch(It ufirst, It ulast, Jt efirst, Jt elast) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<Jt>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        _apply_batch(_input<It>(ufirst), _input<It>(ulast), efirst, elast);
+    }
+
+private:
+    template <typename It, typename Jt>
+    void _apply_batch(It ufirst, It ulast, Jt efirst, Jt elast) {
+        size_t nu = std::distance(ufirst, ulast);
+        size_t ne = std::distance(efirst, elast);
+
+        if (F::value || (nu + ne)*COMPACT_SGTREE_BATCH < _size) {
+            // small batches only touch a few paths
+            for (It i = ufirst; i != ulast; ++i) {
+                _value(_emplace((*i).first).first._i) = (*i).second;
+            }
+
+            for (Jt i = efirst; i != elast; ++i) {
+                iterator f = find(*i);
+                if (f != end()) {
+                    _erase(f._i);
+                }
+            }
+
+            _tidy();
+            return;
+        }
+
+        std::pair<K, V> *us = _allocate<std::pair<K, V>>(nu);
+        size_t j = 0;
+        for (It i = ufirst; i != ulast; ++i) {
+            new (&us[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        K *es;
+        try {
+            es = _allocate<K>(ne);
+        } catch (...) {
+            _release(us, nu);
+            throw;
+        }
+        j = 0;
+        for (Jt i = efirst; i != elast; ++i) {
+            new (&es[j++]) K(*i);
+        }
+
+        std::stable_sort(us, us+nu,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        std::sort(es, es+ne, _less);
+
+        // collapse duplicate upserts into the last one
+        size_t mu = 0;
+        for (j = 0; j < nu; j++) {
+            if (mu > 0 && !_less(us[mu-1].first, us[j].first)) {
+                us[mu-1] = std::move(us[j]);
+            } else {
+                if (mu != j) {
+                    us[mu] = std::move(us[j]);
+                }
+                mu += 1;
+            }
+        }
+
+        // merge the tree, upserts and erases into one sorted run
+        size_t nm = _size + mu;
+        std::pair<K, V> *ms;
+        try {
+            ms = _allocate<std::pair<K, V>>(nm);
+        } catch (...) {
+            _release(nullptr, 0, 0, us, nu, es, ne);
+            throw;
+        }
+        size_t m = 0;
+        size_t a = 0;
+        size_t b = 0;
+        size_t i = _smallest(0);
+        while (i < _capacity || a < mu) {
+            bool up = a < mu &&
+                (i >= _capacity || !_less(_key(i), us[a].first));
+            bool tie = up && i < _capacity && !_less(us[a].first, _key(i));
+            const K &k = up ? us[a].first : _key(i);
+
+            while (b < ne && _less(es[b], k)) {
+                b += 1;
+            }
+
+            if (b >= ne || _less(k, es[b])) {
+                if (up) {
+                    new (&ms[m++]) std::pair<K, V>(std::move(us[a]));
+                } else {
+                    new (&ms[m++]) std::pair<K, V>(
+                            std::move(_key(i)), std::move(_value(i)));
+                }
+            }
+
+            if (up) {
+                a += 1;
+            }
+
+            if (!up || tie) {
+                i = _succ(i);
+            }
+        }
+
+        _free();
+        try {
+            _load(std::make_move_iterator(ms), m);
+        } catch (...) {
+            _release(ms, m, nm, us, nu, es, ne);
+            throw;
+        }
+        _release(ms, m, nm, us, nu, es, ne);
     }
 };
 
-template <typename K, typename V, typename C, typename A>
-class compact_sgtree<K, V, C, A>::iterator {
+template <typename K, typename U, typename C, typename A,
+    typename W, typename S, typename I, typename L, typename N, typename F>
+class compact_sgtree<K, U, C, A, W, S, I, L, N, F>::iterator {
 private:
     friend compact_sgtree;
+    friend class compact_sgtree::reverse_iterator;
     compact_sgtree *_tree;
     size_t _i;
 
@@ -403,8 +2098,14 @@ private:
     }
 
 public:
-    std::pair<K, V> &operator*() { return _tree->_array[_i].pair; }
-    std::pair<K, V> *operator->() { return &_tree->_array[_i].pair; }
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename compact_sgtree::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename compact_sgtree::pointer pointer;
+    typedef typename compact_sgtree::reference reference;
+
+    reference operator*() { return _tree->_ref(_i, _view()); }
+    pointer operator->() { return _tree->_arrow(_i, _view()); }
 
     friend bool operator==(const iterator &a, const iterator &b) {
         return a._i == b._i;
@@ -419,11 +2120,88 @@ public:
         return *this;
     }
 
-    iterator &operator++(int) {
+    iterator operator++(int) {
         iterator old = *this;
         _i = _tree->_succ(_i);
         return old;
     }
+
+    iterator &operator--() {
+        // end sits past the largest slot, so it steps back from there
+        _i = (_i < _tree->_capacity) ? _tree->_pred(_i) : _tree->_largest(0);
+        return *this;
+    }
+
+    iterator operator--(int) {
+        iterator old = *this;
+        operator--();
+        return old;
+    }
+};
+
+template <typename K, typename U, typename C, typename A,
+    typename W, typename S, typename I, typename L, typename N, typename F>
+class compact_sgtree<K, U, C, A, W, S, I, L, N, F>::reverse_iterator {
+private:
+    friend compact_sgtree;
+    compact_sgtree *_tree;
+    size_t _i;
+
+    reverse_iterator(compact_sgtree *tree, size_t i)
+        : _tree(tree), _i(i) {
+    }
+
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename compact_sgtree::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename compact_sgtree::pointer pointer;
+    typedef typename compact_sgtree::reference reference;
+
+    // the iterator just past this one, same as std::reverse_iterator,
+    // rend sits before every slot so its base is begin
+    iterator base() const {
+        if (_i >= _tree->_capacity) {
+            return _tree->begin();
+        }
+        return ++iterator(_tree, _i);
+    }
+
+    reference operator*() { return _tree->_ref(_i, _view()); }
+    pointer operator->() { return _tree->_arrow(_i, _view()); }
+
+    friend bool operator==(const reverse_iterator &a,
+            const reverse_iterator &b) {
+        return a._i == b._i;
+    }
+
+    friend bool operator!=(const reverse_iterator &a,
+            const reverse_iterator &b) {
+        return a._i != b._i;
+    }
+
+    reverse_iterator &operator++() {
+        _i = _tree->_pred(_i);
+        return *this;
+    }
+
+    reverse_iterator operator++(int) {
+        reverse_iterator old = *this;
+        _i = _tree->_pred(_i);
+        return old;
+    }
+
+    reverse_iterator &operator--() {
+        // rend sits before the smallest slot, so it steps up from there
+        _i = (_i < _tree->_capacity) ? _tree->_succ(_i) : _tree->_smallest(0);
+        return *this;
+    }
+
+    reverse_iterator operator--(int) {
+        reverse_iterator old = *this;
+        operator--();
+        return old;
+    }
 };
 
 #endif
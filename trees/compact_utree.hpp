@@ -10,46 +10,224 @@
 
 #include <functional>
 #include <new>
+#include <memory>
 #include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include "snapshot.hpp"
 
-template <typename K, typename V, typename C=std::less<K>>
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename S=std::false_type,
+    typename L=std::allocator<std::pair<const K, V>>>
+class compact_utree;
+
+// Keeps keys and values in separate arrays so that searches only
+// touch keys, iterators hand out pairs of references
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename L=std::allocator<std::pair<const K, V>>>
+using split_utree = compact_utree<K, V, C, std::true_type, L>;
+
+template <typename K, typename V, typename C, typename S, typename L>
 class compact_utree {
 private:
-    struct node {
-        uint8_t deleted;
-        uint8_t left;
-        uint8_t right;
-        std::pair<K, V> pair;
+    // flags are kept out of the array in bitmaps, each group
+    // covers as many slots as there are bits in a word
+    struct flags {
+        uintptr_t deleted;
+        uintptr_t left;
+        uintptr_t right;
+    };
+
+    constexpr static size_t _bits = 8*sizeof(uintptr_t);
+
+    // slots are either stored as pairs, or split into separate arrays of
+    // keys and values so that searching doesn't pull values into cache
+    struct slots {
+        std::pair<K, V> *pairs;
+        K *keys;
+        V *values;
     };
 
+    struct arrow {
+        std::pair<const K &, V &> ref;
+        std::pair<const K &, V &> *operator->() { return &ref; }
+    };
+
+    // comparisons we know are cheap and branch-free, these can search
+    // with conditional moves instead of unpredictable branches
+    typedef std::integral_constant<bool,
+        std::is_arithmetic<K>::value && (
+            std::is_same<C, std::less<K>>::value ||
+            std::is_same<C, std::greater<K>>::value)> _cheap;
+
+    // slots that can be moved with a plain memcpy, these can grow
+    // in place with realloc instead of being copied to a new array
+    typedef std::integral_constant<bool,
+        std::is_trivially_copyable<K>::value &&
+        std::is_trivially_copyable<V>::value> _trivial;
+
+    // slots with nothing to destroy, these can be freed without
+    // visiting them first
+    typedef std::integral_constant<bool,
+        std::is_trivially_destructible<K>::value &&
+        std::is_trivially_destructible<V>::value> _disposable;
+
     C _less;
+    L _allocator;
 
-    node *_array;
+    slots _array;
+    flags *_flags;
     size_t _size;
+    size_t _tombstones;
     size_t _height;
     size_t _capacity;
+    float _max_tombstone_ratio;
+    float _min_load_ratio;
 
 public:
     compact_utree()
-        : _size(0)
+        : compact_utree(L()) {
+    }
+
+    explicit compact_utree(const L &allocator)
+        : _allocator(allocator)
+        , _size(0)
+        , _tombstones(0)
         , _height(3)
-        , _capacity((1 << _height) - 1) {
-        _array = static_cast<node *>(malloc(_capacity*sizeof(node)));
-        new (&_array[0]) node{true, false, false, {K(), V()}};
+        , _capacity((size_t(1) << _height) - 1)
+        , _max_tombstone_ratio(0.5)
+        , _min_load_ratio(0.125) {
+        _array = _alloc(_capacity);
+        _flags = _allocate<flags>(_groups(_capacity));
+        memset(_flags, 0, _groups(_capacity)*sizeof(flags));
+
+        _sentinel();
+    }
+
+    template <typename It>
+    compact_utree(It first, It last, const L &allocator=L())
+        : compact_utree(allocator) {
+        assign(first, last);
     }
 
     ~compact_utree() {
-        for (size_t i = _rawsmallest(0); i < _capacity; i = _rawsucc(i)) {
-            _array[i].pair.~pair();
+        _free();
+    }
+
+    L get_allocator() const {
+        return _allocator;
+    }
+
+    // builds a perfectly balanced tree from a range of key-value
+    // pairs, sorted ranges are placed directly, anything else is sorted
+    // first, only the first of any duplicate keys is kept
+    template <typename It>
+    void assign(It first, It last) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        typedef typename std::iterator_traits<It>::value_type T;
+
+        size_t n = std::distance(first, last);
+        if (std::adjacent_find(first, last, [this](const T &a, const T &b) {
+                    return !_less(a.first, b.first);
+                }) == last) {
+            _free();
+            _load(first, n);
+            return;
         }
 
-        free(_array);
+        std::pair<K, V> *temp = _allocate<std::pair<K, V>>(n);
+        size_t j = 0;
+        for (It i = first; i != last; ++i) {
+            new (&temp[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        std::stable_sort(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        size_t m = std::unique(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return !_less(a.first, b.first);
+                }) - temp;
+
+        _free();
+        try {
+            _load(std::make_move_iterator(temp), m);
+        } catch (...) {
+            _release(temp, n);
+            throw;
+        }
+        _release(temp, n);
+    }
+
+    // writes the pairs in order to a stream, see snapshot.hpp for
+    // the format and how to write other types
+    void save(std::ostream &out) {
+        snapshot_save<K, V>(out, size(), begin(), end());
+    }
+
+    // replaces the tree with a snapshot written by save, pairs are
+    // built into a balanced tree as they're read, so the snapshot
+    // is never held in memory, a damaged snapshot leaves the tree
+    // empty and returns false
+    bool load(std::istream &in) {
+        snapshot_reader<K, V, C> r(in, _less);
+        _free();
+        if (r.checked()) {
+            _load(std::make_move_iterator(r.begin()), r.size());
+        } else {
+            _stream(r);
+        }
+
+        if (!r.ok()) {
+            _free();
+            _load(std::make_move_iterator(r.begin()), 0);
+        }
+        return r.ok();
     }
 
     size_t size() const {
         return _size;
     }
 
+    size_t tombstones() const {
+        return _tombstones;
+    }
+
+    // once this fraction of slots are tombstones, the next insert
+    // compacts the tree before it goes in, erase only leaves the
+    // tombstones, a ratio of 1 never compacts
+    float max_tombstone_ratio() const {
+        return _max_tombstone_ratio;
+    }
+
+    void max_tombstone_ratio(float ratio) {
+        _max_tombstone_ratio = ratio;
+    }
+
+    // once fewer than this fraction of slots hold pairs, the next
+    // insert rebuilds the tree into a smaller array, erase never does,
+    // so call shrink_to_fit after a purge that isn't followed by
+    // inserts, a ratio of 0 never shrinks
+    float min_load_ratio() const {
+        return _min_load_ratio;
+    }
+
+    void min_load_ratio(float ratio) {
+        _min_load_ratio = ratio;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
 private:
     static size_t _parent(size_t i) {
         return (i+1)/2 - 1;
@@ -63,8 +241,209 @@ private:
         return 2*i + 2;
     }
 
+    static size_t _groups(size_t cap) {
+        return (cap + _bits-1) / _bits;
+    }
+
+    bool _isdeleted(size_t i) const {
+        return 1 & (_flags[i/_bits].deleted >> (i%_bits));
+    }
+
+    bool _hasleft(size_t i) const {
+        return 1 & (_flags[i/_bits].left >> (i%_bits));
+    }
+
+    bool _hasright(size_t i) const {
+        return 1 & (_flags[i/_bits].right >> (i%_bits));
+    }
+
+    bool _haschild(size_t i, bool right) const {
+        const flags &f = _flags[i/_bits];
+        return 1 & ((right ? f.right : f.left) >> (i%_bits));
+    }
+
+    static void _setbit(uintptr_t &word, size_t i, bool v) {
+        uintptr_t mask = uintptr_t(1) << (i%_bits);
+        word = v ? word | mask : word & ~mask;
+    }
+
+    void _setdeleted(size_t i, bool v) {
+        _setbit(_flags[i/_bits].deleted, i, v);
+    }
+
+    void _setleft(size_t i, bool v) {
+        _setbit(_flags[i/_bits].left, i, v);
+    }
+
+    void _setright(size_t i, bool v) {
+        _setbit(_flags[i/_bits].right, i, v);
+    }
+
+    void _setflags(size_t i, bool deleted, bool left, bool right) {
+        _setdeleted(i, deleted);
+        _setleft(i, left);
+        _setright(i, right);
+    }
+
+    slots _alloc(size_t cap) {
+        slots s = {nullptr, nullptr, nullptr};
+        if (S::value) {
+            s.keys = _allocate<K>(cap);
+            try {
+                s.values = _allocate<V>(cap);
+            } catch (...) {
+                _deallocate(s.keys, cap);
+                throw;
+            }
+        } else {
+            s.pairs = _allocate<std::pair<K, V>>(cap);
+        }
+        return s;
+    }
+
+    void _realloc(slots &s, size_t cap, size_t ncap) {
+        if (S::value) {
+            s.keys = _reallocate(s.keys, cap, ncap);
+            s.values = _reallocate(s.values, cap, ncap);
+        } else {
+            s.pairs = _reallocate(s.pairs, cap, ncap);
+        }
+    }
+
+    void _dealloc(slots &s, size_t cap) {
+        _deallocate(s.pairs, cap);
+        _deallocate(s.keys, cap);
+        _deallocate(s.values, cap);
+    }
+
+    // the default allocator is mapped straight onto malloc, so that
+    // trivial slots can still grow in place with realloc
+    typedef std::is_same<
+        typename std::allocator_traits<L>::template rebind_alloc<char>,
+        std::allocator<char>> _malloc;
+
+    template <typename T>
+    T *_allocate(size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        if (_malloc::value) {
+            T *p = static_cast<T*>(malloc(n*sizeof(T)));
+            if (!p && n > 0) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        TL a(_allocator);
+        return std::allocator_traits<TL>::allocate(a, n);
+    }
+
+    template <typename T>
+    void _deallocate(T *p, size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        if (_malloc::value) {
+            free(p);
+        } else if (p) {
+            TL a(_allocator);
+            std::allocator_traits<TL>::deallocate(a, p, n);
+        }
+    }
+
+    template <typename T>
+    T *_reallocate(T *p, size_t n, size_t nn) {
+        if (_malloc::value) {
+            // on failure the old block is still ours and still holds
+            // everything, so throw before losing track of it
+            T *np = static_cast<T*>(
+                    realloc(static_cast<void*>(p), nn*sizeof(T)));
+            if (!np && nn > 0) {
+                throw std::bad_alloc();
+            }
+            return np;
+        }
+
+        // only used for trivial slots, so a plain copy is enough
+        T *np = _allocate<T>(nn);
+        memcpy(static_cast<void*>(np), p, std::min(n, nn)*sizeof(T));
+        _deallocate(p, n);
+        return np;
+    }
+
+    K &_key(size_t i) {
+        return S::value ? _array.keys[i] : _array.pairs[i].first;
+    }
+
+    V &_value(size_t i) {
+        return S::value ? _array.values[i] : _array.pairs[i].second;
+    }
+
+    template <typename KK, typename... Args>
+    static void _construct(slots &s, size_t i, KK &&k, Args &&...args) {
+        if (S::value) {
+            new (&s.keys[i]) K(std::forward<KK>(k));
+            new (&s.values[i]) V(std::forward<Args>(args)...);
+        } else {
+            new (&s.pairs[i]) std::pair<K, V>(std::piecewise_construct,
+                    std::forward_as_tuple(std::forward<KK>(k)),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+    }
+
+    static void _destroy(slots &s, size_t i, bool deleted=false) {
+        // tombstones only keep their key around for searching,
+        // their value is destroyed as soon as they are erased
+        if (S::value) {
+            s.keys[i].~K();
+            if (!deleted) {
+                s.values[i].~V();
+            }
+        } else if (deleted) {
+            s.pairs[i].first.~K();
+        } else {
+            s.pairs[i].~pair();
+        }
+    }
+
+    // copies a run of n trivial slots
+    static void _copy(slots &d, size_t di, slots &s, size_t si, size_t n) {
+        if (S::value) {
+            memcpy(static_cast<void*>(&d.keys[di]), &s.keys[si],
+                    n*sizeof(K));
+            memcpy(static_cast<void*>(&d.values[di]), &s.values[si],
+                    n*sizeof(V));
+        } else {
+            memcpy(static_cast<void*>(&d.pairs[di]), &s.pairs[si],
+                    n*sizeof(std::pair<K, V>));
+        }
+    }
+
+    void _relocate(slots &d, size_t di, size_t si) {
+        if (_trivial::value) {
+            _copy(d, di, _array, si, 1);
+            return;
+        }
+
+        _construct(d, di, std::move(_key(si)), std::move(_value(si)));
+        _destroy(_array, si);
+    }
+
+    std::pair<K, V> &_ref(size_t i, std::false_type) {
+        return _array.pairs[i];
+    }
+
+    std::pair<const K &, V &> _ref(size_t i, std::true_type) {
+        return {_array.keys[i], _array.values[i]};
+    }
+
+    std::pair<K, V> *_arrow(size_t i, std::false_type) {
+        return &_array.pairs[i];
+    }
+
+    arrow _arrow(size_t i, std::true_type) {
+        return arrow{_ref(i, std::true_type())};
+    }
+
     size_t _rawsmallest(size_t i) {
-        while (_array[i].left) {
+        while (_hasleft(i)) {
             i = _left(i);
         }
         return i;
@@ -79,14 +458,14 @@ private:
 
     size_t _smallest(size_t i) {
         i = _rawsmallest(i);
-        while (i < _capacity && _array[i].deleted) {
+        while (i < _capacity && _isdeleted(i)) {
             i = _rawsucc(i);
         }
         return i;
     }
 
     size_t _rawlargest(size_t i) {
-        while (_array[i].right) {
+        while (_hasright(i)) {
             i = _right(i);
         }
         return i;
@@ -101,14 +480,14 @@ private:
 
     size_t _largest(size_t i) {
         i = _rawlargest(i);
-        while (i < _capacity && _array[i].deleted) {
-            i = _rawlargest(i);
+        while (i < _capacity && _isdeleted(i)) {
+            i = _rawpred(i);
         }
         return i;
     }
 
     size_t _rawsucc(size_t i) {
-        if (_array[i].right) {
+        if (_hasright(i)) {
             return _rawsmallest(_right(i));
         } else {
             size_t p = _parent(i);
@@ -133,16 +512,38 @@ private:
         }
     }
 
+    // in-order rank of slot i in the pure shape of n slots, which is a
+    // complete tree, so it's the rank i would have in the perfect tree
+    // less the missing leaves that would have come before it
+    static size_t _purerank(size_t n, size_t i) {
+        size_t depth = 0;
+        while ((size_t(2) << depth) <= n) {
+            depth += 1;
+        }
+
+        size_t x = i + 1;
+        size_t d = 0;
+        while ((size_t(2) << d) <= x) {
+            d += 1;
+        }
+
+        size_t rank = (2*(x - (size_t(1) << d)) + 1)
+                * (size_t(1) << (depth-d)) - 1;
+        size_t leaves = n - ((size_t(1) << depth) - 1);
+        size_t before = (rank + 1)/2;
+        return before > leaves ? rank - (before - leaves) : rank;
+    }
+
     size_t _succ(size_t i) {
         i = _rawsucc(i);
-        while (i < _capacity && _array[i].deleted) {
+        while (i < _capacity && _isdeleted(i)) {
             i = _rawsucc(i);
         }
         return i;
     }
 
     size_t _rawpred(size_t i) {
-        if (_array[i].left) {
+        if (_hasleft(i)) {
             return _rawlargest(_left(i));
         } else {
             size_t p = _parent(i);
@@ -169,14 +570,22 @@ private:
 
     size_t _pred(size_t i) {
         i = _rawpred(i);
-        while (i < _capacity && _array[i].deleted) {
+        while (i < _capacity && _isdeleted(i)) {
             i = _rawpred(i);
         }
         return i;
     }
 
 public:
+    typedef typename std::conditional<S::value,
+        std::pair<const K &, V &>,
+        std::pair<K, V> &>::type reference;
+    typedef typename std::conditional<S::value,
+        arrow,
+        std::pair<K, V> *>::type pointer;
+
     class iterator;
+    class reverse_iterator;
 
     iterator begin() {
         return iterator(this, _smallest(0));
@@ -186,83 +595,341 @@ public:
         return iterator(this, -1);
     }
 
+    reverse_iterator rbegin() {
+        return reverse_iterator(this, _largest(0));
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(this, -1);
+    }
+
 private:
     void _expand() {
-        if (_size > _capacity/2) {
-            size_t nheight = _height + 1;
-            size_t ncapacity = (1 << _height) - 1;
-            node *narray = static_cast<node*>(malloc(ncapacity*sizeof(node)));
-
-            size_t bi = _puresmallest(_size, 0);
-            for (size_t i = _rawsmallest(0); i < _capacity; i = _rawsucc(i)) {
-                if (_array[i].deleted) {
-                    _array[i].pair.~pair();
-                    continue;
-                }
+        if (_size > _capacity/2 && _trivial::value) {
+            // adding a level keeps every index valid, so the array can
+            // grow in place and be rebuilt without a second copy
+            _extend();
+            _rebuild();
+        } else if (_size > _capacity/2) {
+            _resize(_height + 1);
+        } else {
+            _rebuild();
+        }
+    }
 
-                new (&narray[bi]) node{
-                    false,
-                    _left(bi) < _size,
-                    _right(bi) < _size,
-                    std::move(_array[i].pair)};
-                _array[i].pair.~pair();
-                bi = _puresucc(_size, bi);
-            }
+    // rebuilds the tree into a new array of the given height in one
+    // pass, the array can be smaller as long as the pairs still fit
+    void _resize(size_t nheight) {
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        if (_trivial::value && nheight < _height) {
+            // rebuilding leaves the pairs in the first size slots, so
+            // trivial slots can shrink in place without being copied
+            _rebuild();
+            _realloc(_array, _capacity, ncapacity);
+            _flags = _reallocate(_flags,
+                    _groups(_capacity), _groups(ncapacity));
 
-            free(_array);
-            _array = narray;
+            // growing assumes flags past the end are clear
+            uintptr_t mask = (uintptr_t(1) << (ncapacity%_bits)) - 1;
+            _flags[ncapacity/_bits].deleted &= mask;
+            _flags[ncapacity/_bits].left &= mask;
+            _flags[ncapacity/_bits].right &= mask;
             _height = nheight;
             _capacity = ncapacity;
-        } else {
-            size_t wi = _purelargest(_capacity, 0);
-            for (size_t i = _rawlargest(0); i < _capacity; i = _rawpred(i)) {
-                if (_array[i].deleted) {
-                    _array[i].pair.~pair();
-                    continue;
+            return;
+        }
+
+        slots narray = _alloc(ncapacity);
+        flags *nflags = _allocate<flags>(_groups(ncapacity));
+        memset(nflags, 0, _groups(ncapacity)*sizeof(flags));
+
+        size_t bi = _puresmallest(_size, 0);
+        for (size_t i = _rawsmallest(0); i < _capacity; i = _rawsucc(i)) {
+            if (_isdeleted(i)) {
+                _destroy(_array, i, true);
+                continue;
+            }
+
+            _relocate(narray, bi, i);
+            _setbit(nflags[bi/_bits].left, bi, _left(bi) < _size);
+            _setbit(nflags[bi/_bits].right, bi, _right(bi) < _size);
+            bi = _puresucc(_size, bi);
+        }
+
+        _dealloc(_array, _capacity);
+        _deallocate(_flags, _groups(_capacity));
+        _array = narray;
+        _flags = nflags;
+        _tombstones = 0;
+        _height = nheight;
+        _capacity = ncapacity;
+
+        if (_size == 0) {
+            _sentinel();
+        }
+    }
+
+    void _extend() {
+        size_t nheight = _height + 1;
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        _realloc(_array, _capacity, ncapacity);
+        _flags = _reallocate(_flags, _groups(_capacity), _groups(ncapacity));
+        memset(&_flags[_groups(_capacity)], 0,
+                (_groups(ncapacity) - _groups(_capacity))*sizeof(flags));
+        _height = nheight;
+        _capacity = ncapacity;
+    }
+
+    void _rebuild() {
+        size_t wi = _purelargest(_capacity, 0);
+        for (size_t i = _rawlargest(0); i < _capacity; i = _rawpred(i)) {
+            if (_isdeleted(i)) {
+                _destroy(_array, i, true);
+                continue;
+            }
+
+            if (wi != i) {
+                _relocate(_array, wi, i);
+            }
+            wi = _purepred(_capacity, wi);
+        }
+
+        size_t bi = _puresmallest(_size, 0);
+        wi = _puresucc(_capacity, wi);
+        for (size_t i = 0; i < _size; i++) {
+            if (bi != wi) {
+                _relocate(_array, bi, wi);
+            }
+            _setflags(bi, false, _left(bi) < _size, _right(bi) < _size);
+            bi = _puresucc(_size, bi);
+            wi = _puresucc(_capacity, wi);
+        }
+
+        _tombstones = 0;
+        if (_size == 0) {
+            _sentinel();
+        }
+    }
+
+    // destroys and frees a scratch array of pairs
+    void _release(std::pair<K, V> *p, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            p[j].~pair();
+        }
+        _deallocate(p, n);
+    }
+
+    // leaves the tree without an array, only _load or the destructor
+    // should follow, but if _load throws the destructor still works
+    void _free() {
+        if (!_disposable::value && _flags) {
+            for (size_t i = _rawsmallest(0); i < _capacity;
+                    i = _rawsucc(i)) {
+                _destroy(_array, i, _isdeleted(i));
+            }
+        }
+
+        _dealloc(_array, _capacity);
+        _deallocate(_flags, _groups(_capacity));
+        _array = slots{nullptr, nullptr, nullptr};
+        _flags = nullptr;
+        _height = 0;
+        _capacity = 0;
+        _size = 0;
+        _tombstones = 0;
+    }
+
+    // smallest height of array that fits n pairs
+    static size_t _fit(size_t n) {
+        size_t h = 3;
+        while ((size_t(1) << h) - 1 < n) {
+            h += 1;
+        }
+        return h;
+    }
+
+    // after a mass erase most of the array can be empty, rebuild into
+    // a smaller one with a level to spare so inserts don't immediately
+    // grow it again
+    void _contract() {
+        if (_size >= _min_load_ratio*_capacity) {
+            return;
+        }
+
+        size_t nheight = std::min(_fit(_size) + 1, _height - 1);
+        if (nheight >= _fit(_size)) {
+            _resize(nheight);
+        }
+    }
+
+    template <typename It>
+    void _load(It first, size_t n) {
+        // nothing changes until the arrays are ours
+        size_t height = _fit(n);
+        size_t capacity = (size_t(1) << height) - 1;
+        slots narray = _alloc(capacity);
+        flags *nflags;
+        try {
+            nflags = _allocate<flags>(_groups(capacity));
+        } catch (...) {
+            _dealloc(narray, capacity);
+            throw;
+        }
+
+        _height = height;
+        _capacity = capacity;
+        _array = narray;
+        _flags = nflags;
+        memset(_flags, 0, _groups(_capacity)*sizeof(flags));
+
+        // sorted input lands in order on the pure shape of n slots
+        size_t bi = _puresmallest(n, 0);
+        for (size_t i = 0; i < n; i++, ++first) {
+            _construct(_array, bi, (*first).first, (*first).second);
+            _setflags(bi, false, _left(bi) < n, _right(bi) < n);
+            bi = _puresucc(n, bi);
+        }
+
+        _size = n;
+        _tombstones = 0;
+
+        if (n == 0) {
+            _sentinel();
+        }
+    }
+
+    // a count nothing vouches for only goes as far as the pairs do, so
+    // the array grows a level at a time as they arrive, filling the
+    // first slots in order, which is always the pure shape of that many
+    // slots, and the pairs only move into place once they're all here
+    template <typename R>
+    void _stream(R &r) {
+        auto it = std::make_move_iterator(r.begin());
+        _load(it, 0);
+        _destroy(_array, 0, true);
+        _setflags(0, false, false, false);
+        _tombstones = 0;
+
+        try {
+            for (; r.size() > 0 && r.ok(); ++it) {
+                if (_size == _capacity) {
+                    _widen();
                 }
 
-                if (wi != i) {
-                    new (&_array[wi].pair) std::pair<K, V>{
-                        std::move(_array[i].pair)};
-                    _array[i].pair.~pair();
+                _construct(_array, _size, (*it).first, (*it).second);
+                if (_size > 0) {
+                    size_t p = _parent(_size);
+                    _setflags(p, false, _left(p) <= _size, _right(p) <= _size);
                 }
-                wi = _purepred(_capacity, wi);
+                _size += 1;
+            }
+        } catch (...) {
+            // the pairs aren't in place yet, so don't leave them, but
+            // _free expects an empty tree to still have its sentinel
+            if (_size == 0) {
+                _sentinel();
             }
+            _free();
+            _load(it, 0);
+            throw;
+        }
 
-            size_t bi = _puresmallest(_size, 0);
-            wi = _puresucc(_capacity, wi);
-            for (size_t i = 0; i < _size; i++) {
-                if (bi != wi) {
-                    new (&_array[bi]) node{
-                        false,
-                        _left(bi) < _size,
-                        _right(bi) < _size,
-                        std::move(_array[wi].pair)};
-                    _array[wi].pair.~pair();
+        if (_size == 0) {
+            _sentinel();
+            return;
+        } else if (!r.ok()) {
+            return;
+        }
+
+        _arrange(_size);
+    }
+
+    // adds a level to the array without moving any slot
+    void _widen() {
+        if (_trivial::value) {
+            _extend();
+            return;
+        }
+
+        size_t nheight = _height + 1;
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        slots narray = _alloc(ncapacity);
+        flags *nflags;
+        try {
+            nflags = _allocate<flags>(_groups(ncapacity));
+        } catch (...) {
+            _dealloc(narray, ncapacity);
+            throw;
+        }
+
+        for (size_t i = 0; i < _size; i++) {
+            _relocate(narray, i, i);
+        }
+        memset(nflags, 0, _groups(ncapacity)*sizeof(flags));
+        memcpy(nflags, _flags, _groups(_capacity)*sizeof(flags));
+
+        _dealloc(_array, _capacity);
+        _deallocate(_flags, _groups(_capacity));
+        _array = narray;
+        _flags = nflags;
+        _height = nheight;
+        _capacity = ncapacity;
+    }
+
+    // moves n pairs sorted into the first n slots onto the pure shape
+    // of n slots, following each cycle of the permutation once, with
+    // the deleted flags marking slots that already hold their pair
+    void _arrange(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (_isdeleted(i) || _purerank(n, i) == i) {
+                continue;
+            }
+
+            std::pair<K, V> t(std::move(_key(i)), std::move(_value(i)));
+            _destroy(_array, i);
+            size_t j = i;
+            while (true) {
+                size_t r = _purerank(n, j);
+                _setdeleted(j, true);
+                if (r == i) {
+                    break;
                 }
-                bi = _puresucc(_size, bi);
-                wi = _puresucc(_capacity, wi);
+
+                _relocate(_array, j, r);
+                j = r;
             }
+            _construct(_array, j, std::move(t.first), std::move(t.second));
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            _setflags(i, false, _left(i) < n, _right(i) < n);
         }
     }
 
-public:
-    iterator find(const K &k) {
+    void _sentinel() {
+        // an empty tree still needs a root to search from
+        new (&_key(0)) K();
+        _setflags(0, true, false, false);
+        _tombstones += 1;
+    }
+
+    template <typename Q>
+    iterator _find(const Q &k, std::false_type) {
         size_t i = 0;
 
         while (true) {
-            if (_less(k, _array[i].pair.first)) {
-                if (!_array[i].left) {
+            if (_less(k, _key(i))) {
+                if (!_hasleft(i)) {
                     return end();
                 }
                 i = _left(i);
-            } else if (_less(_array[i].pair.first, k)) {
-                if (!_array[i].right) {
+            } else if (_less(_key(i), k)) {
+                if (!_hasright(i)) {
                     return end();
                 }
                 i = _right(i);
             } else {
-                if (_array[i].deleted) {
+                if (_isdeleted(i)) {
                     return end();
                 }
                 return iterator(this, i);
@@ -270,57 +937,257 @@ public:
         }
     }
 
-    V &operator[](const K &k) {
+    template <typename Q>
+    iterator _find(const Q &k, std::true_type) {
         size_t i = 0;
-        uint8_t *branch = nullptr;
 
         while (true) {
-            if (_less(k, _array[i].pair.first)) {
-                if (!_array[i].left) {
-                    branch = &_array[i].left;
+            const K &key = _key(i);
+            if (!_less(k, key) && !_less(key, k)) {
+                if (_isdeleted(i)) {
+                    return end();
+                }
+                return iterator(this, i);
+            }
+
+            bool right = _less(key, k);
+            if (!_haschild(i, right)) {
+                return end();
+            }
+            i = _left(i) + right;
+        }
+    }
+
+    template <typename Q>
+    size_t _seek(const Q &k, bool upper) {
+        // the last slot we went left at is the first key past k
+        size_t i = 0;
+        size_t b = -1;
+
+        while (true) {
+            bool right = upper ? !_less(k, _key(i)) : _less(_key(i), k);
+            if (!right) {
+                b = i;
+            }
+
+            if (!_haschild(i, right)) {
+                break;
+            }
+            i = _left(i) + right;
+        }
+
+        // tombstones keep their place in order, so skip past them
+        if (b < _capacity && _isdeleted(b)) {
+            b = _succ(b);
+        }
+        return b;
+    }
+
+public:
+    iterator find(const K &k) {
+        return _find(k, _cheap());
+    }
+
+    // transparent comparators can look up anything comparable
+    // with K without building a temporary key
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator find(const Q &k) {
+        return _find(k, _cheap());
+    }
+
+    size_t count(const K &k) {
+        return find(k) != end();
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    size_t count(const Q &k) {
+        return find(k) != end();
+    }
+
+    iterator lower_bound(const K &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator lower_bound(const Q &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    iterator upper_bound(const K &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator upper_bound(const Q &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    std::pair<iterator, iterator> equal_range(const K &k) {
+        // keys are unique, so the range is at most one past lower_bound
+        size_t i = _seek(k, false);
+        if (i < _capacity && !_less(k, _key(i))) {
+            return std::make_pair(iterator(this, i), iterator(this, _succ(i)));
+        }
+        return std::make_pair(iterator(this, i), iterator(this, i));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    std::pair<iterator, iterator> equal_range(const Q &k) {
+        size_t i = _seek(k, false);
+        if (i < _capacity && !_less(k, _key(i))) {
+            return std::make_pair(iterator(this, i), iterator(this, _succ(i)));
+        }
+        return std::make_pair(iterator(this, i), iterator(this, i));
+    }
+
+private:
+    // cleans up after erases, which leave tombstones and never move
+    // anything so that iterators stay valid
+    void _tidy() {
+        if (_tombstones == 0) {
+            return;
+        }
+
+        // contracting also clears out the tombstones
+        _contract();
+        if (_tombstones > _max_tombstone_ratio*(_size + _tombstones)) {
+            compact();
+        }
+    }
+
+    template <typename KK, typename... Args>
+    std::pair<iterator, bool> _emplace(KK &&k, Args &&...args) {
+        _tidy();
+
+        size_t i = 0;
+
+        while (true) {
+            if (_less(k, _key(i))) {
+                if (!_hasleft(i)) {
                     i = _left(i);
                     break;
                 }
                 i = _left(i);
-            } else if (_less(_array[i].pair.first, k)) {
-                if (!_array[i].right) {
-                    branch = &_array[i].right;
+            } else if (_less(_key(i), k)) {
+                if (!_hasright(i)) {
                     i = _right(i);
                     break;
                 }
                 i = _right(i);
             } else {
-                if (_array[i].deleted) {
-                    _array[i].deleted = false;
-                    _array[i].pair = std::pair<K, V>(k, V());
-                    _size += 1;
+                if (!_isdeleted(i)) {
+                    return std::make_pair(iterator(this, i), false);
                 }
-                return _array[i].pair.second;
+
+                _setdeleted(i, false);
+                _key(i) = std::forward<KK>(k);
+                new (&_value(i)) V(std::forward<Args>(args)...);
+                _size += 1;
+                _tombstones -= 1;
+                return std::make_pair(iterator(this, i), true);
             }
         }
 
         if (i >= _capacity) {
             _expand();
-            return operator[](k);
+            return _emplace(
+                    std::forward<KK>(k), std::forward<Args>(args)...);
         }
 
-        *branch = true;
-        new (&_array[i]) node{false, false, false, {k, V()}};
+        if (i == _left(_parent(i))) {
+            _setleft(_parent(i), true);
+        } else {
+            _setright(_parent(i), true);
+        }
+
+        _construct(_array, i,
+                std::forward<KK>(k), std::forward<Args>(args)...);
+        _setflags(i, false, false, false);
         _size += 1;
 
-        return _array[i].pair.second;
+        return std::make_pair(iterator(this, i), true);
+    }
+
+public:
+    V &operator[](const K &k) {
+        return _value(_emplace(k).first._i);
+    }
+
+    V &operator[](K &&k) {
+        return _value(_emplace(std::move(k)).first._i);
+    }
+
+    // constructs a pair from args, like std::map this builds the pair
+    // before knowing if the key is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        std::pair<K, V> p(std::forward<Args>(args)...);
+        return _emplace(std::move(p.first), std::move(p.second));
+    }
+
+    // only constructs the value if k isn't already in the tree
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &k, Args &&...args) {
+        return _emplace(k, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K &&k, Args &&...args) {
+        return _emplace(std::move(k), std::forward<Args>(args)...);
     }
 
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const K &k, M &&m) {
+        std::pair<iterator, bool> r = _emplace(k, std::forward<M>(m));
+        if (!r.second) {
+            _value(r.first._i) = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(K &&k, M &&m) {
+        std::pair<iterator, bool> r =
+                _emplace(std::move(k), std::forward<M>(m));
+        if (!r.second) {
+            _value(r.first._i) = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    // erasing only invalidates iterators to the erased pair, the
+    // tombstone it leaves and any shrinking wait for the next insert,
+    // inserts, compact, and shrink_to_fit may move everything
     void erase(iterator p) {
-        _array[p._i].deleted = true;
+        _value(p._i).~V();
+        _setdeleted(p._i, true);
         _size -= 1;
+        _tombstones += 1;
+    }
+
+    // rebuilds the tree in place without any tombstones
+    void compact() {
+        _rebuild();
+    }
+
+    // rebuilds the tree into the smallest array that fits it
+    void shrink_to_fit() {
+        if (_fit(_size) < _height) {
+            _resize(_fit(_size));
+        }
     }
 };
 
-template <typename K, typename V, typename C>
-class compact_utree<K, V, C>::iterator {
+template <typename K, typename V, typename C, typename S, typename L>
+class compact_utree<K, V, C, S, L>::iterator {
 private:
     friend compact_utree;
+    friend class compact_utree::reverse_iterator;
     compact_utree *_tree;
     size_t _i;
 
@@ -329,8 +1196,14 @@ private:
     }
 
 public:
-    std::pair<K, V> &operator*() { return _tree->_array[_i].pair; }
-    std::pair<K, V> *operator->() { return &_tree->_array[_i].pair; }
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef std::pair<K, V> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename compact_utree::pointer pointer;
+    typedef typename compact_utree::reference reference;
+
+    reference operator*() { return _tree->_ref(_i, S()); }
+    pointer operator->() { return _tree->_arrow(_i, S()); }
 
     friend bool operator==(const iterator &a, const iterator &b) {
         return a._i == b._i;
@@ -345,11 +1218,87 @@ public:
         return *this;
     }
 
-    iterator &operator++(int) {
+    iterator operator++(int) {
         iterator old = *this;
         _i = _tree->_succ(_i);
         return old;
     }
+
+    iterator &operator--() {
+        // end sits past the largest slot, so it steps back from there
+        _i = (_i < _tree->_capacity) ? _tree->_pred(_i) : _tree->_largest(0);
+        return *this;
+    }
+
+    iterator operator--(int) {
+        iterator old = *this;
+        operator--();
+        return old;
+    }
+};
+
+template <typename K, typename V, typename C, typename S, typename L>
+class compact_utree<K, V, C, S, L>::reverse_iterator {
+private:
+    friend compact_utree;
+    compact_utree *_tree;
+    size_t _i;
+
+    reverse_iterator(compact_utree *tree, size_t i)
+        : _tree(tree), _i(i) {
+    }
+
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef std::pair<K, V> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename compact_utree::pointer pointer;
+    typedef typename compact_utree::reference reference;
+
+    // the iterator just past this one, same as std::reverse_iterator,
+    // rend sits before every slot so its base is begin
+    iterator base() const {
+        if (_i >= _tree->_capacity) {
+            return _tree->begin();
+        }
+        return ++iterator(_tree, _i);
+    }
+
+    reference operator*() { return _tree->_ref(_i, S()); }
+    pointer operator->() { return _tree->_arrow(_i, S()); }
+
+    friend bool operator==(const reverse_iterator &a,
+            const reverse_iterator &b) {
+        return a._i == b._i;
+    }
+
+    friend bool operator!=(const reverse_iterator &a,
+            const reverse_iterator &b) {
+        return a._i != b._i;
+    }
+
+    reverse_iterator &operator++() {
+        _i = _tree->_pred(_i);
+        return *this;
+    }
+
+    reverse_iterator operator++(int) {
+        reverse_iterator old = *this;
+        _i = _tree->_pred(_i);
+        return old;
+    }
+
+    reverse_iterator &operator--() {
+        // rend sits before the smallest slot, so it steps up from there
+        _i = (_i < _tree->_capacity) ? _tree->_succ(_i) : _tree->_smallest(0);
+        return *this;
+    }
+
+    reverse_iterator operator--(int) {
+        reverse_iterator old = *this;
+        operator--();
+        return old;
+    }
 };
 
 #endif
@@ -0,0 +1,133 @@
+/*
+ * Allocator that puts large arrays on huge pages
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license
+ */
+
+#ifndef HUGEPAGE_ALLOCATOR_HPP
+#define HUGEPAGE_ALLOCATOR_HPP
+
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+
+// Size of a huge page, arrays are aligned and rounded up to this
+#ifndef HUGEPAGE_SIZE
+#define HUGEPAGE_SIZE (size_t(2) << 20)
+#endif
+
+// Allocations smaller than this come from the normal heap
+#ifndef HUGEPAGE_THRESHOLD
+#define HUGEPAGE_THRESHOLD HUGEPAGE_SIZE
+#endif
+
+// Try the reserved hugetlb pool before transparent huge pages, this
+// needs pages set aside in /proc/sys/vm/nr_hugepages
+#ifndef HUGEPAGE_HUGETLB
+#define HUGEPAGE_HUGETLB false
+#endif
+
+// The array trees walk a root-to-leaf path across a different page at
+// every level, so once an array is much larger than the TLB covers
+// most of a search is spent on TLB misses. Giving the trees this
+// allocator puts any allocation of at least threshold bytes on 2MB
+// pages, which covers the same array with far fewer TLB entries.
+//
+// Without huge page support the memory is still aligned, it just
+// ends up on normal pages.
+template <typename T>
+class hugepage_allocator {
+private:
+    size_t _threshold;
+
+    static size_t _round(size_t bytes) {
+        return (bytes + HUGEPAGE_SIZE-1) & ~(HUGEPAGE_SIZE-1);
+    }
+
+    static void *_map(size_t length) {
+#if HUGEPAGE_HUGETLB && defined(MAP_HUGETLB)
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= (HUGEPAGE_SIZE == (size_t(2) << 20)) ? MAP_HUGE_2MB : 0;
+#endif
+        void *p = mmap(nullptr, length,
+                PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p != MAP_FAILED) {
+            return p;
+        }
+#endif
+
+        // mmap only promises normal page alignment, so map an extra
+        // huge page and trim the ends off
+        char *p = static_cast<char*>(mmap(nullptr, length + HUGEPAGE_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+
+        char *a = reinterpret_cast<char*>(_round(uintptr_t(p)));
+        if (a > p) {
+            munmap(p, a - p);
+        }
+        munmap(a + length, (p + HUGEPAGE_SIZE) - a);
+
+#ifdef MADV_HUGEPAGE
+        madvise(a, length, MADV_HUGEPAGE);
+#endif
+        return a;
+    }
+
+public:
+    typedef T value_type;
+
+    explicit hugepage_allocator(size_t threshold=HUGEPAGE_THRESHOLD)
+        : _threshold(threshold) {
+    }
+
+    template <typename U>
+    hugepage_allocator(const hugepage_allocator<U> &other)
+        : _threshold(other.threshold()) {
+    }
+
+    size_t threshold() const {
+        return _threshold;
+    }
+
+    T *allocate(size_t n) {
+        if (n*sizeof(T) < _threshold) {
+            return static_cast<T*>(::operator new(n*sizeof(T)));
+        }
+
+        void *p = _map(_round(n*sizeof(T)));
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n*sizeof(T) < _threshold) {
+            ::operator delete(p);
+        } else {
+            munmap(p, _round(n*sizeof(T)));
+        }
+    }
+
+    // whether memory is on huge pages depends on the threshold, so
+    // memory can only be freed by an allocator with the same one
+    template <typename U>
+    friend bool operator==(const hugepage_allocator &a,
+            const hugepage_allocator<U> &b) {
+        return a.threshold() == b.threshold();
+    }
+
+    template <typename U>
+    friend bool operator!=(const hugepage_allocator &a,
+            const hugepage_allocator<U> &b) {
+        return a.threshold() != b.threshold();
+    }
+};
+
+#endif
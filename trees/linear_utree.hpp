@@ -10,9 +10,17 @@
 
 #include <functional>
 #include <new>
+#include <memory>
 #include <cstring>
-
-template <typename K, typename V, typename C=std::less<K>>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include "snapshot.hpp"
+
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename L=std::allocator<std::pair<const K, V>>>
 class linear_utree {
 private:
     struct node {
@@ -21,36 +29,160 @@ private:
         std::pair<K, V> pair;
     };
 
+    // comparisons we know are cheap and branch-free, these can search
+    // with conditional moves instead of unpredictable branches
+    typedef std::integral_constant<bool,
+        std::is_arithmetic<K>::value && (
+            std::is_same<C, std::less<K>>::value ||
+            std::is_same<C, std::greater<K>>::value)> _cheap;
+
     C _less;
+    L _allocator;
 
     node *_array;
     size_t _size;
+    size_t _tombstones;
     size_t _height;
     size_t _capacity;
+    float _max_tombstone_ratio;
+    float _min_load_ratio;
 
 public:
     linear_utree()
-        : _size(0)
+        : linear_utree(L()) {
+    }
+
+    explicit linear_utree(const L &allocator)
+        : _allocator(allocator)
+        , _size(0)
+        , _tombstones(0)
         , _height(3)
-        , _capacity((1 << _height) - 1) {
-        _array = static_cast<node *>(malloc(_capacity*sizeof(node)));
+        , _capacity((size_t(1) << _height) - 1)
+        , _max_tombstone_ratio(0.5)
+        , _min_load_ratio(0.125) {
+        _array = _allocate<node>(_capacity);
         memset(_array, 0, _capacity*sizeof(node));
     }
 
+    template <typename It>
+    linear_utree(It first, It last, const L &allocator=L())
+        : linear_utree(allocator) {
+        assign(first, last);
+    }
+
     ~linear_utree() {
-        for (size_t i = 0; i < _capacity; i++) {
-            if (_array[i].exists && !_array[i].deleted) {
-                _array[i].pair.~pair();
-            }
+        _free();
+    }
+
+    L get_allocator() const {
+        return _allocator;
+    }
+
+    // builds a perfectly balanced tree from a range of key-value
+    // pairs, sorted ranges are placed directly, anything else is sorted
+    // first, only the first of any duplicate keys is kept
+    template <typename It>
+    void assign(It first, It last) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        typedef typename std::iterator_traits<It>::value_type T;
+
+        size_t n = std::distance(first, last);
+        if (std::adjacent_find(first, last, [this](const T &a, const T &b) {
+                    return !_less(a.first, b.first);
+                }) == last) {
+            _free();
+            _load(first, n);
+            return;
+        }
+
+        std::pair<K, V> *temp = _allocate<std::pair<K, V>>(n);
+        size_t j = 0;
+        for (It i = first; i != last; ++i) {
+            new (&temp[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        std::stable_sort(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        size_t m = std::unique(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return !_less(a.first, b.first);
+                }) - temp;
+
+        _free();
+        try {
+            _load(std::make_move_iterator(temp), m);
+        } catch (...) {
+            _release(temp, n);
+            throw;
         }
+        _release(temp, n);
+    }
+
+    // writes the pairs in order to a stream, see snapshot.hpp for
+    // the format and how to write other types
+    void save(std::ostream &out) {
+        snapshot_save<K, V>(out, size(), begin(), end());
+    }
 
-        free(_array);
+    // replaces the tree with a snapshot written by save, pairs are
+    // built into a balanced tree as they're read, so the snapshot
+    // is never held in memory, a damaged snapshot leaves the tree
+    // empty and returns false
+    bool load(std::istream &in) {
+        snapshot_reader<K, V, C> r(in, _less);
+        _free();
+        if (r.checked()) {
+            _load(std::make_move_iterator(r.begin()), r.size());
+        } else {
+            _stream(r);
+        }
+
+        if (!r.ok()) {
+            _free();
+            _load(std::make_move_iterator(r.begin()), 0);
+        }
+        return r.ok();
     }
 
     size_t size() const {
         return _size;
     }
 
+    size_t tombstones() const {
+        return _tombstones;
+    }
+
+    // once this fraction of slots are tombstones, the next insert
+    // compacts the tree before it goes in, erase only leaves the
+    // tombstones, a ratio of 1 never compacts
+    float max_tombstone_ratio() const {
+        return _max_tombstone_ratio;
+    }
+
+    void max_tombstone_ratio(float ratio) {
+        _max_tombstone_ratio = ratio;
+    }
+
+    // once fewer than this fraction of slots hold pairs, the next
+    // insert rebuilds the tree into a smaller array, erase never does,
+    // so call shrink_to_fit after a purge that isn't followed by
+    // inserts, a ratio of 0 never shrinks
+    float min_load_ratio() const {
+        return _min_load_ratio;
+    }
+
+    void min_load_ratio(float ratio) {
+        _min_load_ratio = ratio;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
 public:
     class iterator;
 
@@ -68,6 +200,186 @@ public:
     }
 
 private:
+    static void _destroy(node *n) {
+        // tombstones only keep their key around for searching,
+        // their value is destroyed as soon as they are erased
+        if (n->deleted) {
+            n->pair.first.~K();
+        } else {
+            n->pair.~pair();
+        }
+    }
+
+    template <typename T>
+    T *_allocate(size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        TL a(_allocator);
+        return std::allocator_traits<TL>::allocate(a, n);
+    }
+
+    template <typename T>
+    void _deallocate(T *p, size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        if (p) {
+            TL a(_allocator);
+            std::allocator_traits<TL>::deallocate(a, p, n);
+        }
+    }
+
+    // destroys and frees a scratch array of pairs
+    void _release(std::pair<K, V> *p, size_t n) {
+        for (size_t j = 0; j < n; j++) {
+            p[j].~pair();
+        }
+        _deallocate(p, n);
+    }
+
+    // leaves the tree without an array, only _load or the destructor
+    // should follow, but if _load throws the destructor still works
+    void _free() {
+        for (size_t i = 0; i < _capacity; i++) {
+            if (_array[i].exists) {
+                _destroy(&_array[i]);
+            }
+        }
+
+        _deallocate(_array, _capacity);
+        _array = nullptr;
+        _height = 0;
+        _capacity = 0;
+        _size = 0;
+        _tombstones = 0;
+    }
+
+    // smallest height of array that fits n pairs
+    static size_t _fit(size_t n) {
+        size_t h = 3;
+        while ((size_t(1) << h) - 1 < n) {
+            h += 1;
+        }
+        return h;
+    }
+
+    // after a mass erase most of the array can be empty, rebuild into
+    // a smaller one with a level to spare so inserts don't immediately
+    // grow it again
+    void _contract() {
+        if (_size >= _min_load_ratio*_capacity) {
+            return;
+        }
+
+        size_t nheight = std::min(_fit(_size) + 1, _height - 1);
+        if (nheight >= _fit(_size)) {
+            _rebuild(nheight);
+        }
+    }
+
+    template <typename It>
+    void _load(It first, size_t n) {
+        // nothing changes until the array is ours
+        size_t height = _fit(n);
+        size_t capacity = (size_t(1) << height) - 1;
+        _array = _allocate<node>(capacity);
+        _height = height;
+        _capacity = capacity;
+        memset(_array, 0, _capacity*sizeof(node));
+
+        _load(first, 0, _capacity, n);
+        _size = n;
+        _tombstones = 0;
+    }
+
+    template <typename It>
+    void _load(It &it, size_t l, size_t h, size_t len) {
+        // same placement as _build, but filled in order so sorted
+        // input can be consumed as it goes
+        if (len == 0) {
+            return;
+        }
+
+        size_t i = (l + h)/2;
+        size_t j = len/2;
+
+        _load(it, l, i, j);
+        _array[i].exists = true;
+        new (&_array[i].pair) std::pair<K, V>((*it).first, (*it).second);
+        ++it;
+        _load(it, i+1, h, len-(j+1));
+    }
+
+    // a count nothing vouches for only goes as far as the pairs do, so
+    // the array grows a level at a time as they arrive, filling the
+    // first slots in order, and the pairs only spread out to where
+    // _load would have put them once they're all here
+    template <typename R>
+    void _stream(R &r) {
+        auto it = std::make_move_iterator(r.begin());
+        _load(it, 0);
+
+        try {
+            for (; r.size() > 0 && r.ok(); ++it) {
+                if (_size == _capacity) {
+                    _widen();
+                }
+
+                new (&_array[_size].pair) std::pair<K, V>(
+                        (*it).first, (*it).second);
+                _array[_size].exists = true;
+                _size += 1;
+            }
+        } catch (...) {
+            // the pairs aren't in place yet, so don't leave them
+            _free();
+            _load(it, 0);
+            throw;
+        }
+
+        if (r.ok()) {
+            _arrange(0, _capacity, _size, 0);
+        }
+    }
+
+    // adds a level to the array, keeping every pair at its index
+    void _widen() {
+        size_t nheight = _height + 1;
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        node *narray = _allocate<node>(ncapacity);
+        memset(narray, 0, ncapacity*sizeof(node));
+
+        for (size_t i = 0; i < _size; i++) {
+            narray[i].exists = true;
+            new (&narray[i].pair) std::pair<K, V>(std::move(_array[i].pair));
+            _destroy(&_array[i]);
+        }
+
+        _deallocate(_array, _capacity);
+        _array = narray;
+        _height = nheight;
+        _capacity = ncapacity;
+    }
+
+    // moves the len pairs sitting in order from slot r onto the same
+    // placement as _load, largest first, each only ever moves right,
+    // so it never lands on a pair that hasn't moved yet
+    void _arrange(size_t l, size_t h, size_t len, size_t r) {
+        if (len == 0) {
+            return;
+        }
+
+        size_t i = (l + h)/2;
+        size_t j = len/2;
+
+        _arrange(i+1, h, len-(j+1), r+j+1);
+        if (i != r+j) {
+            _array[i].exists = true;
+            new (&_array[i].pair) std::pair<K, V>(
+                    std::move(_array[r+j].pair));
+            _destroy(&_array[r+j]);
+            _array[r+j].exists = false;
+        }
+        _arrange(l, i, j, r);
+    }
+
     void _build(size_t l, size_t h, std::pair<K, V> *temp, size_t len) {
         if (len == 0) {
             return;
@@ -85,33 +397,65 @@ private:
     }
 
     void _expand() {
-        std::pair<K, V> *temp = static_cast<std::pair<K, V>*>(
-                malloc(_size*sizeof(std::pair<K, V>)));
+        _rebuild(_size > _capacity/2 ? _height+1 : _height);
+    }
+
+    // rebuilds the tree into an array of the given height, the array
+    // can be smaller as long as the pairs still fit
+    void _rebuild(size_t nheight) {
+        std::pair<K, V> *temp = _allocate<std::pair<K, V>>(_size);
         size_t j = 0;
         for (size_t i = 0; i < _capacity; i++) {
             if (_array[i].exists) {
                 if (!_array[i].deleted) {
                     new (&temp[j++]) std::pair<K, V>(std::move(_array[i].pair));
                 }
-                _array[i].pair.~pair();
+                _destroy(&_array[i]);
             }
         }
 
-        if (_size > _capacity/2) {
-            free(_array);
+        _tombstones = 0;
+        if (nheight != _height) {
+            _deallocate(_array, _capacity);
 
-            _height += 1;
-            _capacity = (1 << _height) - 1;
-            _array = static_cast<node*>(malloc(_capacity*sizeof(node)));
+            _height = nheight;
+            _capacity = (size_t(1) << _height) - 1;
+            _array = _allocate<node>(_capacity);
         }
 
         memset(_array, 0, _capacity*sizeof(node));
         _build(0, _capacity, temp, _size);
-        free(temp);
+        _deallocate(temp, _size);
     }
 
-public:
-    iterator find(const K &k) {
+    template <typename Q>
+    node *_seek(const Q &k, bool upper) {
+        size_t l = 0;
+        size_t h = _capacity;
+        size_t i = (l + h) / 2;
+
+        while (l < h && _array[i].exists) {
+            bool right = upper
+                ? !_less(k, _array[i].pair.first)
+                : _less(_array[i].pair.first, k);
+            if (right) {
+                l = i+1;
+            } else {
+                h = i;
+            }
+            i = (l + h) / 2;
+        }
+
+        // what's left of [l, h) is empty, so the first key past k is
+        // at h, unless it's a tombstone
+        while (h < _capacity && (!_array[h].exists || _array[h].deleted)) {
+            h++;
+        }
+        return &_array[h];
+    }
+
+    template <typename Q>
+    iterator _find(const Q &k, std::false_type) {
         ssize_t l = 0;
         ssize_t h = _capacity;
         size_t i = (l + h) / 2;
@@ -134,7 +478,113 @@ public:
         return end();
     }
 
-    V &operator[](const K &k) {
+    template <typename Q>
+    iterator _find(const Q &k, std::true_type) {
+        size_t l = 0;
+        size_t h = _capacity;
+        size_t i = (l + h) / 2;
+
+        while (l < h && _array[i].exists) {
+            const K &key = _array[i].pair.first;
+            if (!_less(k, key) && !_less(key, k)) {
+                if (_array[i].deleted) {
+                    return end();
+                }
+                return iterator(this, &_array[i]);
+            }
+
+            bool right = _less(key, k);
+            l = right ? i+1 : l;
+            h = right ? h : i;
+            i = (l + h) / 2;
+        }
+
+        return end();
+    }
+
+public:
+    iterator find(const K &k) {
+        return _find(k, _cheap());
+    }
+
+    // transparent comparators can look up anything comparable
+    // with K without building a temporary key
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator find(const Q &k) {
+        return _find(k, _cheap());
+    }
+
+    size_t count(const K &k) {
+        return find(k) != end();
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    size_t count(const Q &k) {
+        return find(k) != end();
+    }
+
+    iterator lower_bound(const K &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator lower_bound(const Q &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    iterator upper_bound(const K &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator upper_bound(const Q &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    std::pair<iterator, iterator> equal_range(const K &k) {
+        // keys are unique, so the range is at most one past lower_bound
+        iterator i = lower_bound(k);
+        iterator j = i;
+        if (i != end() && !_less(k, i->first)) {
+            ++j;
+        }
+        return std::make_pair(i, j);
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    std::pair<iterator, iterator> equal_range(const Q &k) {
+        iterator i = lower_bound(k);
+        iterator j = i;
+        if (i != end() && !_less(k, i->first)) {
+            ++j;
+        }
+        return std::make_pair(i, j);
+    }
+
+private:
+    // cleans up after erases, which leave tombstones and never move
+    // anything so that iterators stay valid
+    void _tidy() {
+        if (_tombstones == 0) {
+            return;
+        }
+
+        // contracting also clears out the tombstones
+        _contract();
+        if (_tombstones > _max_tombstone_ratio*(_size + _tombstones)) {
+            compact();
+        }
+    }
+
+    template <typename KK, typename... Args>
+    std::pair<iterator, bool> _emplace(KK &&k, Args &&...args) {
+        _tidy();
+
         ssize_t l = 0;
         ssize_t h = _capacity;
         size_t i = (l + h) / 2;
@@ -147,36 +597,106 @@ public:
                 l = i+1;
                 i = (l + h) / 2;
             } else {
-                if (_array[i].deleted) {
-                    _array[i].deleted = false;
-                    _array[i].pair = std::pair<K, V>(k, V());
-                    _size += 1;
+                if (!_array[i].deleted) {
+                    return std::make_pair(iterator(this, &_array[i]), false);
                 }
 
-                return _array[i].pair.second;
+                _array[i].deleted = false;
+                _array[i].pair.first = std::forward<KK>(k);
+                new (&_array[i].pair.second) V(std::forward<Args>(args)...);
+                _size += 1;
+                _tombstones -= 1;
+                return std::make_pair(iterator(this, &_array[i]), true);
             }
         }
 
         if (l >= h) {
             _expand();
-            return operator[](k);
+            return _emplace(
+                    std::forward<KK>(k), std::forward<Args>(args)...);
         }
 
         _array[i].exists = true;
-        new (&_array[i].pair) std::pair<K, V>(k, V());
+        new (&_array[i].pair) std::pair<K, V>(std::piecewise_construct,
+                std::forward_as_tuple(std::forward<KK>(k)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
         _size += 1;
 
-        return _array[i].pair.second;
+        return std::make_pair(iterator(this, &_array[i]), true);
     }
 
+public:
+    V &operator[](const K &k) {
+        return _emplace(k).first->second;
+    }
+
+    V &operator[](K &&k) {
+        return _emplace(std::move(k)).first->second;
+    }
+
+    // constructs a pair from args, like std::map this builds the pair
+    // before knowing if the key is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        std::pair<K, V> p(std::forward<Args>(args)...);
+        return _emplace(std::move(p.first), std::move(p.second));
+    }
+
+    // only constructs the value if k isn't already in the tree
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &k, Args &&...args) {
+        return _emplace(k, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K &&k, Args &&...args) {
+        return _emplace(std::move(k), std::forward<Args>(args)...);
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const K &k, M &&m) {
+        std::pair<iterator, bool> r = _emplace(k, std::forward<M>(m));
+        if (!r.second) {
+            r.first->second = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(K &&k, M &&m) {
+        std::pair<iterator, bool> r =
+                _emplace(std::move(k), std::forward<M>(m));
+        if (!r.second) {
+            r.first->second = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    // erasing only invalidates iterators to the erased pair, the
+    // tombstone it leaves and any shrinking wait for the next insert,
+    // inserts, compact, and shrink_to_fit may move everything
     void erase(iterator p) {
+        p._node->pair.second.~V();
         p._node->deleted = true;
         _size -= 1;
+        _tombstones += 1;
+    }
+
+    // rebuilds the tree in place without any tombstones
+    void compact() {
+        _rebuild(_height);
+    }
+
+    // rebuilds the tree into the smallest array that fits it
+    void shrink_to_fit() {
+        if (_fit(_size) < _height) {
+            _rebuild(_fit(_size));
+        }
     }
 };
 
-template <typename K, typename V, typename C>
-class linear_utree<K, V, C>::iterator {
+template <typename K, typename V, typename C, typename L>
+class linear_utree<K, V, C, L>::iterator {
 private:
     friend linear_utree;
     node *_node;
@@ -208,7 +728,7 @@ public:
         return *this;
     }
 
-    iterator &operator++(int) {
+    iterator operator++(int) {
         iterator old = *this;
         operator++();
         return old;
@@ -0,0 +1,1270 @@
+/*
+ * Compact scapegoat tree stored in a memory-mapped file
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license
+ */
+
+#ifndef MAPPED_SGTREE_HPP
+#define MAPPED_SGTREE_HPP
+
+#include <functional>
+#include <new>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <cassert>
+#include <ratio>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <system_error>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "snapshot.hpp"
+
+// Number of levels to prefetch ahead while descending, the descendants
+// that many levels down are contiguous in the array, 0 disables
+#ifndef MAPPED_SGTREE_PREFETCH
+#define MAPPED_SGTREE_PREFETCH 3
+#endif
+
+// Bumped whenever the layout of the file changes, files written
+// with any other version are refused on open
+#define MAPPED_SGTREE_VERSION 1
+
+// Same array as compact_sgtree, but the header, slots and flags all
+// live in one shared mapping, so a tree stored in a file can be opened
+// again without rebuilding or even reading it, only trivially copyable
+// keys and values can be stored this way
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename A=std::ratio<1,2>>
+class mapped_sgtree {
+private:
+    static_assert(std::is_trivially_copyable<K>::value &&
+        std::is_trivially_copyable<V>::value,
+        "mapped_sgtree can only store trivially copyable types");
+
+    // the file starts with a header that describes the tree, followed
+    // by the array of slots and then the flags, so growing the tree
+    // only has to move the flags
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t keysize;
+        uint32_t valuesize;
+        uint32_t alphanum;
+        uint32_t alphaden;
+        uint32_t reserved;
+        uint64_t size;
+        uint64_t tombstones;
+        uint64_t height;
+        uint64_t capacity;
+    };
+
+    struct flags {
+        uintptr_t deleted;
+        uintptr_t left;
+        uintptr_t right;
+    };
+
+    constexpr static size_t _bits = 8*sizeof(uintptr_t);
+
+    // comparisons we know are cheap and branch-free, these can search
+    // with conditional moves instead of unpredictable branches
+    typedef std::integral_constant<bool,
+        std::is_arithmetic<K>::value && (
+            std::is_same<C, std::less<K>>::value ||
+            std::is_same<C, std::greater<K>>::value)> _cheap;
+
+    C _less;
+    constexpr static double _alpha = double(A::num)/double(A::den);
+
+    // the file descriptor is -1 when the tree only lives in memory
+    int _fd;
+    void *_map;
+    size_t _length;
+
+    header *_header;
+    std::pair<K, V> *_pairs;
+    flags *_flags;
+    size_t _capacity;
+    float _max_tombstone_ratio;
+    float _min_load_ratio;
+
+    size_t _depthlimit;
+    size_t _depthlower;
+    size_t _depthupper;
+
+public:
+    // a tree in anonymous memory, nothing is kept once it's gone
+    mapped_sgtree()
+        : _fd(-1)
+        , _map(nullptr)
+        , _length(0)
+        , _max_tombstone_ratio(0.5)
+        , _min_load_ratio(0.125)
+        , _depthlimit(0)
+        , _depthlower(0)
+        , _depthupper(0) {
+        _create(0);
+        _sentinel();
+    }
+
+    // opens the tree stored at path, creating it if the file is empty,
+    // the slots aren't read until they are searched, if the file can't
+    // be mapped or its header doesn't match this tree, the tree is
+    // left in memory and is_open() is false
+    explicit mapped_sgtree(const char *path)
+        : _fd(-1)
+        , _map(nullptr)
+        , _length(0)
+        , _max_tombstone_ratio(0.5)
+        , _min_load_ratio(0.125)
+        , _depthlimit(0)
+        , _depthlower(0)
+        , _depthupper(0) {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            _create(0);
+            _sentinel();
+            return;
+        }
+
+        if (st.st_size == 0) {
+            _fd = fd;
+            try {
+                _create(0);
+            } catch (const std::system_error &) {
+                close(fd);
+                _fd = -1;
+                _create(0);
+            }
+            _sentinel();
+            return;
+        }
+
+        void *map = MAP_FAILED;
+        if (size_t(st.st_size) >= sizeof(header)) {
+            map = mmap(nullptr, st.st_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        if (map == MAP_FAILED ||
+                !_valid(static_cast<header*>(map), st.st_size)) {
+            if (map != MAP_FAILED) {
+                munmap(map, st.st_size);
+            }
+            close(fd);
+            _create(0);
+            _sentinel();
+            return;
+        }
+
+        _fd = fd;
+        _map = map;
+        _length = st.st_size;
+        _header = static_cast<header*>(_map);
+        _capacity = _header->capacity;
+        _pairs = _pairsat();
+        _flags = _flagsat(_capacity);
+    }
+
+    template <typename It>
+    mapped_sgtree(It first, It last)
+        : mapped_sgtree() {
+        assign(first, last);
+    }
+
+    mapped_sgtree(const mapped_sgtree &) = delete;
+    mapped_sgtree &operator=(const mapped_sgtree &) = delete;
+
+    ~mapped_sgtree() {
+        munmap(_map, _length);
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    // builds a perfectly balanced tree from a range of key-value
+    // pairs, sorted ranges are placed directly, anything else is sorted
+    // first, only the first of any duplicate keys is kept
+    template <typename It>
+    void assign(It first, It last) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        typedef typename std::iterator_traits<It>::value_type T;
+
+        size_t n = std::distance(first, last);
+        if (std::adjacent_find(first, last, [this](const T &a, const T &b) {
+                    return !_less(a.first, b.first);
+                }) == last) {
+            _load(first, n);
+            return;
+        }
+
+        std::pair<K, V> *temp = static_cast<std::pair<K, V>*>(
+                malloc(n*sizeof(std::pair<K, V>)));
+        size_t j = 0;
+        for (It i = first; i != last; ++i) {
+            new (&temp[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        std::stable_sort(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        size_t m = std::unique(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return !_less(a.first, b.first);
+                }) - temp;
+
+        _load(temp, m);
+        free(temp);
+    }
+
+    // writes the pairs in order to a stream, see snapshot.hpp for
+    // the format and how to write other types
+    void save(std::ostream &out) {
+        snapshot_save<K, V>(out, size(), begin(), end());
+    }
+
+    // replaces the tree with a snapshot written by save, pairs are
+    // built into a balanced tree as they're read, so the snapshot
+    // is never held in memory, a damaged snapshot leaves the tree
+    // empty and returns false
+    bool load(std::istream &in) {
+        snapshot_reader<K, V, C> r(in, _less);
+        if (r.checked()) {
+            _load(std::make_move_iterator(r.begin()), r.size());
+        } else {
+            _stream(r);
+        }
+
+        if (!r.ok()) {
+            _load(std::make_move_iterator(r.begin()), 0);
+        }
+        return r.ok();
+    }
+
+    // false if the tree couldn't be opened from a file
+    bool is_open() const {
+        return _fd >= 0;
+    }
+
+    // changes go straight to the mapping, and so to the file once the
+    // kernel gets around to it, sync waits for them to reach the disk
+    void sync() {
+        if (_fd >= 0) {
+            msync(_map, _length, MS_SYNC);
+        }
+    }
+
+    size_t size() const {
+        return _header->size;
+    }
+
+    size_t tombstones() const {
+        return _header->tombstones;
+    }
+
+    // once this fraction of slots are tombstones, the next insert
+    // compacts the tree before it goes in, erase only leaves the
+    // tombstones, a ratio of 1 never compacts
+    float max_tombstone_ratio() const {
+        return _max_tombstone_ratio;
+    }
+
+    void max_tombstone_ratio(float ratio) {
+        _max_tombstone_ratio = ratio;
+    }
+
+    // once fewer than this fraction of slots hold pairs, the next
+    // insert shrinks the array and the file, erase never does, so call
+    // shrink_to_fit after a purge that isn't followed by inserts, a
+    // ratio of 0 never shrinks
+    float min_load_ratio() const {
+        return _min_load_ratio;
+    }
+
+    void min_load_ratio(float ratio) {
+        _min_load_ratio = ratio;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+private:
+    static size_t _parent(size_t i) {
+        return (i+1)/2 - 1;
+    }
+
+    static size_t _left(size_t i) {
+        return 2*i + 1;
+    }
+
+    static size_t _right(size_t i) {
+        return 2*i + 2;
+    }
+
+    static size_t _sibling(size_t i) {
+        return ((i+1)^1)-1;
+    }
+
+    static size_t _groups(size_t cap) {
+        return (cap + _bits-1) / _bits;
+    }
+
+    static size_t _pairsoffset() {
+        return (sizeof(header) + alignof(std::pair<K, V>)-1)
+                & ~(alignof(std::pair<K, V>)-1);
+    }
+
+    static size_t _flagsoffset(size_t cap) {
+        return (_pairsoffset() + cap*sizeof(std::pair<K, V>)
+                + alignof(flags)-1) & ~(alignof(flags)-1);
+    }
+
+    static size_t _bytes(size_t cap) {
+        return _flagsoffset(cap) + _groups(cap)*sizeof(flags);
+    }
+
+    std::pair<K, V> *_pairsat() {
+        return reinterpret_cast<std::pair<K, V>*>(
+                static_cast<char*>(_map) + _pairsoffset());
+    }
+
+    flags *_flagsat(size_t cap) {
+        return reinterpret_cast<flags*>(
+                static_cast<char*>(_map) + _flagsoffset(cap));
+    }
+
+    static bool _valid(const header *h, size_t length) {
+        return memcmp(h->magic, "sgtree", 7) == 0
+            && h->version == MAPPED_SGTREE_VERSION
+            && h->keysize == sizeof(K)
+            && h->valuesize == sizeof(V)
+            && h->alphanum == A::num
+            && h->alphaden == A::den
+            && h->height > 0 && h->height < 8*sizeof(size_t)
+            && h->capacity == (size_t(1) << h->height) - 1
+            && h->size + h->tombstones <= h->capacity
+            && length >= _bytes(h->capacity);
+    }
+
+    // maps length bytes in place of the current mapping, if that fails
+    // the old mapping is kept and the error is thrown, the same way
+    // hugepage_allocator fails
+    void _remap(size_t length) {
+        void *map;
+        if (_fd >= 0) {
+            // the old pages stay in the file, so we can map it again,
+            // but pages past the end of the file fault when touched
+            if (length > _length && ftruncate(_fd, length) < 0) {
+                throw std::system_error(errno, std::generic_category(),
+                        "mapped_sgtree: ftruncate");
+            }
+
+            map = mmap(nullptr, length,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+            if (map == MAP_FAILED) {
+                int err = errno;
+                if (length > _length && _map) {
+                    // best effort, a longer file still opens fine
+                    bool trimmed = ftruncate(_fd, _length) == 0;
+                    (void)trimmed;
+                }
+                throw std::system_error(err, std::generic_category(),
+                        "mapped_sgtree: mmap");
+            }
+
+            if (_map) {
+                munmap(_map, _length);
+            }
+
+            if (length < _length) {
+                // nothing past the new end is mapped anymore, failing
+                // to trim the file only wastes the space
+                bool trimmed = ftruncate(_fd, length) == 0;
+                (void)trimmed;
+            }
+        } else {
+            map = mmap(nullptr, length,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (map == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+
+            if (_map) {
+                memcpy(map, _map, std::min(length, _length));
+                munmap(_map, _length);
+            }
+        }
+
+        _map = map;
+        _length = length;
+        _header = static_cast<header*>(_map);
+        _pairs = _pairsat();
+    }
+
+    // smallest height of array that fits n pairs
+    static size_t _fit(size_t n) {
+        size_t h = 3;
+        while ((size_t(1) << h) - 1 < n) {
+            h += 1;
+        }
+        return h;
+    }
+
+    void _create(size_t n) {
+        size_t height = _fit(n);
+        _capacity = (size_t(1) << height) - 1;
+        _remap(_bytes(_capacity));
+        _flags = _flagsat(_capacity);
+        memset(_flags, 0, _groups(_capacity)*sizeof(flags));
+
+        memset(_header, 0, sizeof(header));
+        memcpy(_header->magic, "sgtree", 7);
+        _header->version = MAPPED_SGTREE_VERSION;
+        _header->keysize = sizeof(K);
+        _header->valuesize = sizeof(V);
+        _header->alphanum = A::num;
+        _header->alphaden = A::den;
+        _header->height = height;
+        _header->capacity = _capacity;
+    }
+
+    bool _isdeleted(size_t i) const {
+        return 1 & (_flags[i/_bits].deleted >> (i%_bits));
+    }
+
+    bool _hasleft(size_t i) const {
+        return 1 & (_flags[i/_bits].left >> (i%_bits));
+    }
+
+    bool _hasright(size_t i) const {
+        return 1 & (_flags[i/_bits].right >> (i%_bits));
+    }
+
+    bool _haschild(size_t i, bool right) const {
+        const flags &f = _flags[i/_bits];
+        return 1 & ((right ? f.right : f.left) >> (i%_bits));
+    }
+
+    static void _setbit(uintptr_t &word, size_t i, bool v) {
+        uintptr_t mask = uintptr_t(1) << (i%_bits);
+        word = v ? word | mask : word & ~mask;
+    }
+
+    void _setdeleted(size_t i, bool v) {
+        _setbit(_flags[i/_bits].deleted, i, v);
+    }
+
+    void _setleft(size_t i, bool v) {
+        _setbit(_flags[i/_bits].left, i, v);
+    }
+
+    void _setright(size_t i, bool v) {
+        _setbit(_flags[i/_bits].right, i, v);
+    }
+
+    void _setflags(size_t i, bool deleted, bool left, bool right) {
+        _setdeleted(i, deleted);
+        _setleft(i, left);
+        _setright(i, right);
+    }
+
+    K &_key(size_t i) {
+        return _pairs[i].first;
+    }
+
+    V &_value(size_t i) {
+        return _pairs[i].second;
+    }
+
+    void _prefetch(size_t i) {
+#if MAPPED_SGTREE_PREFETCH > 0
+        // descendants a few levels down sit next to each other, so we
+        // can start fetching them long before we know which one we need
+        size_t lo = ((i+1) << MAPPED_SGTREE_PREFETCH) - 1;
+        size_t hi = lo + (size_t(1) << MAPPED_SGTREE_PREFETCH);
+        if (hi > _capacity) {
+            return;
+        }
+
+        size_t step = 64 / sizeof(std::pair<K, V>);
+        for (size_t j = lo; j < hi; j += step ? step : 1) {
+            __builtin_prefetch(&_key(j));
+        }
+        __builtin_prefetch(&_key(hi-1));
+        __builtin_prefetch(&_flags[lo/_bits]);
+#endif
+    }
+
+    size_t _rawsmallest(size_t i) {
+        while (_hasleft(i)) {
+            i = _left(i);
+        }
+        return i;
+    }
+
+    size_t _puresmallest(size_t cap, size_t i) {
+        while (_left(i) < cap) {
+            i = _left(i);
+        }
+        return i;
+    }
+
+    size_t _smallest(size_t i) {
+        i = _rawsmallest(i);
+        while (i < _capacity && _isdeleted(i)) {
+            i = _rawsucc(i);
+        }
+        return i;
+    }
+
+    size_t _rawlargest(size_t i) {
+        while (_hasright(i)) {
+            i = _right(i);
+        }
+        return i;
+    }
+
+    size_t _purelargest(size_t cap, size_t i) {
+        while (_right(i) < cap) {
+            i = _right(i);
+        }
+        return i;
+    }
+
+    size_t _largest(size_t i) {
+        i = _rawlargest(i);
+        while (i < _capacity && _isdeleted(i)) {
+            i = _rawpred(i);
+        }
+        return i;
+    }
+
+    size_t _rawsucc(size_t i) {
+        if (_hasright(i)) {
+            return _rawsmallest(_right(i));
+        } else {
+            size_t p = _parent(i);
+            while (p < _capacity && i != _left(p)) {
+                i = p;
+                p = _parent(p);
+            }
+            return p;
+        }
+    }
+
+    size_t _puresucc(size_t cap, size_t i) {
+        if (_right(i) < cap) {
+            return _puresmallest(cap, _right(i));
+        } else {
+            size_t p = _parent(i);
+            while (p < cap && i != _left(p)) {
+                i = p;
+                p = _parent(p);
+            }
+            return p;
+        }
+    }
+
+    // in-order rank of slot i in the pure shape of n slots, which is a
+    // complete tree, so it's the rank i would have in the perfect tree
+    // less the missing leaves that would have come before it
+    static size_t _purerank(size_t n, size_t i) {
+        size_t depth = 0;
+        while ((size_t(2) << depth) <= n) {
+            depth += 1;
+        }
+
+        size_t x = i + 1;
+        size_t d = 0;
+        while ((size_t(2) << d) <= x) {
+            d += 1;
+        }
+
+        size_t rank = (2*(x - (size_t(1) << d)) + 1)
+                * (size_t(1) << (depth-d)) - 1;
+        size_t leaves = n - ((size_t(1) << depth) - 1);
+        size_t before = (rank + 1)/2;
+        return before > leaves ? rank - (before - leaves) : rank;
+    }
+
+    size_t _succ(size_t i) {
+        i = _rawsucc(i);
+        while (i < _capacity && _isdeleted(i)) {
+            i = _rawsucc(i);
+        }
+        return i;
+    }
+
+    size_t _rawpred(size_t i) {
+        if (_hasleft(i)) {
+            return _rawlargest(_left(i));
+        } else {
+            size_t p = _parent(i);
+            while (p < _capacity && i != _right(p)) {
+                i = p;
+                p = _parent(p);
+            }
+            return p;
+        }
+    }
+
+    size_t _purepred(size_t cap, size_t i) {
+        if (_left(i) < cap) {
+            return _purelargest(cap, _left(i));
+        } else {
+            size_t p = _parent(i);
+            while (p < cap && i != _right(p)) {
+                i = p;
+                p = _parent(p);
+            }
+            return p;
+        }
+    }
+
+    size_t _pred(size_t i) {
+        i = _rawpred(i);
+        while (i < _capacity && _isdeleted(i)) {
+            i = _rawpred(i);
+        }
+        return i;
+    }
+
+public:
+    class iterator;
+
+    iterator begin() {
+        return iterator(this, _smallest(0));
+    }
+
+    iterator end() {
+        return iterator(this, -1);
+    }
+
+private:
+    void _expand() {
+        _widen();
+        compact();
+    }
+
+    void _widen() {
+        // adding a level keeps every index valid, so only the flags
+        // have to move out of the way of the new slots
+        size_t ncapacity = 2*_capacity + 1;
+        size_t groups = _groups(_capacity);
+        size_t ngroups = _groups(ncapacity);
+
+        size_t offset = _flagsoffset(_capacity);
+        _remap(_bytes(ncapacity));
+        _flags = _flagsat(ncapacity);
+        memmove(_flags, static_cast<char*>(_map) + offset,
+                groups*sizeof(flags));
+        memset(&_flags[groups], 0, (ngroups - groups)*sizeof(flags));
+
+        _capacity = ncapacity;
+        _header->height += 1;
+        _header->capacity = ncapacity;
+    }
+
+    // compacting leaves the pairs in the first size slots, so the
+    // array can shrink in place once the flags move down to the new end
+    void _shrink(size_t nheight) {
+        compact();
+
+        size_t ncapacity = (size_t(1) << nheight) - 1;
+        memmove(_flagsat(ncapacity), _flags,
+                _groups(ncapacity)*sizeof(flags));
+        try {
+            _remap(_bytes(ncapacity));
+        } catch (...) {
+            // the old mapping is still there, only the front of the
+            // flags could have been overwritten by the move
+            memmove(_flags, _flagsat(ncapacity),
+                    _groups(ncapacity)*sizeof(flags));
+            throw;
+        }
+        _flags = _flagsat(ncapacity);
+
+        _capacity = ncapacity;
+        _header->height = nheight;
+        _header->capacity = ncapacity;
+    }
+
+    // after a mass erase most of the array can be empty, shrink it with
+    // a level to spare so inserts don't immediately grow it again
+    void _contract() {
+        if (_header->size >= _min_load_ratio*_capacity) {
+            return;
+        }
+
+        size_t nheight = std::min(_fit(_header->size) + 1,
+                size_t(_header->height) - 1);
+        if (nheight >= _fit(_header->size)) {
+            _shrink(nheight);
+        }
+    }
+
+    template <typename It>
+    void _load(It first, size_t n) {
+        // remapping over the old tree keeps it if the new one can't
+        // be mapped
+        _create(n);
+
+        // sorted input lands in order on the pure shape of n slots
+        size_t bi = _puresmallest(n, 0);
+        for (size_t i = 0; i < n; i++, ++first) {
+            new (&_pairs[bi]) std::pair<K, V>((*first).first, (*first).second);
+            _setflags(bi, false, _left(bi) < n, _right(bi) < n);
+            bi = _puresucc(n, bi);
+        }
+
+        _header->size = n;
+
+        if (n == 0) {
+            _sentinel();
+        }
+    }
+
+    // a count nothing vouches for only goes as far as the pairs do, so
+    // the file grows a level at a time as they arrive, filling the
+    // first slots in order, which is always the pure shape of that many
+    // slots, and the pairs only move into place once they're all here
+    template <typename R>
+    void _stream(R &r) {
+        auto it = std::make_move_iterator(r.begin());
+        _create(0);
+
+        size_t n = 0;
+        try {
+            for (; r.size() > 0 && r.ok(); ++it) {
+                if (n == _capacity) {
+                    _widen();
+                }
+
+                new (&_pairs[n]) std::pair<K, V>((*it).first, (*it).second);
+                if (n > 0) {
+                    size_t p = _parent(n);
+                    _setflags(p, false, _left(p) <= n, _right(p) <= n);
+                }
+                n += 1;
+                _header->size = n;
+            }
+        } catch (...) {
+            // the pairs aren't in place yet, so don't leave them
+            _load(it, 0);
+            throw;
+        }
+
+        if (!r.ok()) {
+            return;
+        }
+
+        _arrange(n);
+        if (n == 0) {
+            _sentinel();
+        }
+    }
+
+    // moves n pairs sorted into the first n slots onto the pure shape
+    // of n slots, following each cycle of the permutation once, with
+    // the deleted flags marking slots that already hold their pair
+    void _arrange(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (_isdeleted(i) || _purerank(n, i) == i) {
+                continue;
+            }
+
+            std::pair<K, V> t = _pairs[i];
+            size_t j = i;
+            while (true) {
+                size_t r = _purerank(n, j);
+                _setdeleted(j, true);
+                if (r == i) {
+                    break;
+                }
+
+                _pairs[j] = _pairs[r];
+                j = r;
+            }
+            _pairs[j] = t;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            _setflags(i, false, _left(i) < n, _right(i) < n);
+        }
+    }
+
+    void _sentinel() {
+        // an empty tree still needs a root to search from
+        new (&_key(0)) K();
+        _setflags(0, true, false, false);
+        _header->tombstones += 1;
+    }
+
+    static size_t _bound(size_t root, size_t size) {
+        if (size == 0) {
+            return 0;
+        }
+
+        return size + root*(size_t(1) << int(log2(size)));
+    }
+
+    void _rebalance(size_t root, size_t w) {
+        size_t h = 0;
+        for (size_t i = root; i < _capacity; i = _left(i)) {
+            h += 1;
+        }
+
+        size_t wc = _bound(root, (size_t(1) << h) - 1);
+        size_t bc = _bound(root, w);
+
+        size_t wi = _purelargest(wc, root);
+        size_t ci = _rawlargest(root);
+        while (ci+1 > root) {
+            if (_isdeleted(ci)) {
+                _header->tombstones -= 1;
+                ci = _rawpred(ci);
+                continue;
+            }
+
+            if (wi != ci) {
+                _pairs[wi] = _pairs[ci];
+            }
+
+            _setdeleted(wi, true);
+            wi = _purepred(wc, wi);
+            ci = _rawpred(ci);
+        }
+
+        size_t bi = _puresmallest(bc, root);
+        wi = _puresucc(wc, wi);
+        while (wi+1 > root) {
+            if (bi != wi) {
+                _pairs[bi] = _pairs[wi];
+            }
+
+            _setflags(bi, false, _left(bi) < bc, _right(bi) < bc);
+
+            bi = _puresucc(bc, bi);
+            wi = _puresucc(wc, wi);
+        }
+    }
+
+    size_t _weigh(size_t root) {
+        size_t w = 0;
+        for (size_t i = _rawsmallest(root); i+1 > root; i = _rawsucc(i)) {
+            w += !_isdeleted(i);
+        }
+        return w;
+    }
+
+    size_t _maxdepth() {
+        // log(size)/log(1/alpha) rounded down, only recomputed when
+        // the size leaves [_depthlower, _depthupper)
+        if (A::num >= A::den) {
+            return size_t(-1) >> 1;
+        }
+
+        size_t size = _header->size;
+        if (size < _depthlower || size >= _depthupper) {
+            constexpr double ialpha = double(A::den)/double(A::num);
+            double t = 1;
+            _depthlimit = 0;
+            while (t*ialpha <= size) {
+                t *= ialpha;
+                _depthlimit += 1;
+            }
+
+            _depthlower = ceil(t);
+            _depthupper = ceil(t*ialpha);
+        }
+
+        return _depthlimit;
+    }
+
+    std::pair<size_t, size_t> _scapegoat(size_t i) {
+        // weights include the new element at i, but since we rebuild
+        // before inserting, only take a scapegoat if rebuilding it
+        // is sure to shorten the path to i
+        size_t w = 1;
+        size_t h = 1;
+
+        while (i > 0) {
+            size_t p = _parent(i);
+            bool sibling = (i == _left(p)) ? _hasright(p) : _hasleft(p);
+            size_t pw = (sibling ? _weigh(_sibling(i)) : 0)
+                    + w + !_isdeleted(p);
+            h += 1;
+
+            if (w > _alpha * pw + 1 && size_t(log2(pw)) + 2 < h) {
+                return std::make_pair(p, pw - 1);
+            }
+
+            i = p;
+            w = pw;
+        }
+
+        // tombstones can leave the tree too deep without any
+        // unbalanced subtree, just rebuild the whole thing
+        return std::make_pair(0, w - 1);
+    }
+
+    template <typename Q>
+    iterator _find(const Q &k, std::false_type) {
+        size_t i = 0;
+
+        while (true) {
+            _prefetch(i);
+
+            if (_less(k, _key(i))) {
+                if (!_hasleft(i)) {
+                    return end();
+                }
+                i = _left(i);
+            } else if (_less(_key(i), k)) {
+                if (!_hasright(i)) {
+                    return end();
+                }
+                i = _right(i);
+            } else {
+                if (_isdeleted(i)) {
+                    return end();
+                }
+                return iterator(this, i);
+            }
+        }
+    }
+
+    template <typename Q>
+    iterator _find(const Q &k, std::true_type) {
+        size_t i = 0;
+
+        while (true) {
+            _prefetch(i);
+
+            const K &key = _key(i);
+            if (!_less(k, key) && !_less(key, k)) {
+                if (_isdeleted(i)) {
+                    return end();
+                }
+                return iterator(this, i);
+            }
+
+            bool right = _less(key, k);
+            if (!_haschild(i, right)) {
+                return end();
+            }
+            i = _left(i) + right;
+        }
+    }
+
+    template <typename Q>
+    size_t _seek(const Q &k, bool upper) {
+        // the last slot we went left at is the first key past k
+        size_t i = 0;
+        size_t b = -1;
+
+        while (true) {
+            _prefetch(i);
+
+            bool right = upper ? !_less(k, _key(i)) : _less(_key(i), k);
+            if (!right) {
+                b = i;
+            }
+
+            if (!_haschild(i, right)) {
+                break;
+            }
+            i = _left(i) + right;
+        }
+
+        // tombstones keep their place in order, so skip past them
+        if (b < _capacity && _isdeleted(b)) {
+            b = _succ(b);
+        }
+        return b;
+    }
+
+public:
+    iterator find(const K &k) {
+        return _find(k, _cheap());
+    }
+
+    // transparent comparators can look up anything comparable
+    // with K without building a temporary key
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator find(const Q &k) {
+        return _find(k, _cheap());
+    }
+
+    size_t count(const K &k) {
+        return find(k) != end();
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    size_t count(const Q &k) {
+        return find(k) != end();
+    }
+
+    iterator lower_bound(const K &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator lower_bound(const Q &k) {
+        return iterator(this, _seek(k, false));
+    }
+
+    iterator upper_bound(const K &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator upper_bound(const Q &k) {
+        return iterator(this, _seek(k, true));
+    }
+
+    std::pair<iterator, iterator> equal_range(const K &k) {
+        // keys are unique, so the range is at most one past lower_bound
+        size_t i = _seek(k, false);
+        if (i < _capacity && !_less(k, _key(i))) {
+            return std::make_pair(iterator(this, i), iterator(this, _succ(i)));
+        }
+        return std::make_pair(iterator(this, i), iterator(this, i));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    std::pair<iterator, iterator> equal_range(const Q &k) {
+        size_t i = _seek(k, false);
+        if (i < _capacity && !_less(k, _key(i))) {
+            return std::make_pair(iterator(this, i), iterator(this, _succ(i)));
+        }
+        return std::make_pair(iterator(this, i), iterator(this, i));
+    }
+
+private:
+    // cleans up after erases, which leave tombstones and never move
+    // anything so that iterators stay valid
+    void _tidy() {
+        if (_header->tombstones == 0) {
+            return;
+        }
+
+        // shrinking also clears out the tombstones
+        _contract();
+        if (_header->tombstones > _max_tombstone_ratio*(
+                _header->size + _header->tombstones)) {
+            compact();
+        }
+    }
+
+    template <typename KK, typename... Args>
+    std::pair<iterator, bool> _emplace(KK &&k, Args &&...args) {
+        _tidy();
+
+        size_t i = 0;
+        size_t depth = 0;
+
+        while (true) {
+            while (true) {
+                _prefetch(i);
+
+                if (_less(k, _key(i))) {
+                    if (!_hasleft(i)) {
+                        i = _left(i);
+                        break;
+                    }
+                    i = _left(i);
+                    depth += 1;
+                } else if (_less(_key(i), k)) {
+                    if (!_hasright(i)) {
+                        i = _right(i);
+                        break;
+                    }
+                    i = _right(i);
+                    depth += 1;
+                } else {
+                    if (!_isdeleted(i)) {
+                        return std::make_pair(iterator(this, i), false);
+                    }
+
+                    _setdeleted(i, false);
+                    _key(i) = std::forward<KK>(k);
+                    new (&_value(i)) V(std::forward<Args>(args)...);
+                    _header->size += 1;
+                    _header->tombstones -= 1;
+                    return std::make_pair(iterator(this, i), true);
+                }
+            }
+
+            if (_header->size > 0 && depth > _maxdepth() + 2) {
+                std::pair<size_t, size_t> sg = _scapegoat(i);
+                _rebalance(sg.first, sg.second);
+
+                // only the scapegoat's subtree moved, so the search
+                // can pick back up from there
+                i = sg.first;
+                depth = 0;
+                for (size_t j = i; j > 0; j = _parent(j)) {
+                    depth += 1;
+                }
+                continue;
+            }
+
+            if (i >= _capacity) {
+                _expand();
+                i = 0;
+                depth = 0;
+                continue;
+            }
+
+            break;
+        }
+
+        if (i == _left(_parent(i))) {
+            _setleft(_parent(i), true);
+        } else {
+            _setright(_parent(i), true);
+        }
+
+        new (&_pairs[i]) std::pair<K, V>(std::piecewise_construct,
+                std::forward_as_tuple(std::forward<KK>(k)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+        _setflags(i, false, false, false);
+        _header->size += 1;
+
+        return std::make_pair(iterator(this, i), true);
+    }
+
+public:
+    V &operator[](const K &k) {
+        return _value(_emplace(k).first._i);
+    }
+
+    // constructs a pair from args, like std::map this builds the pair
+    // before knowing if the key is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        std::pair<K, V> p(std::forward<Args>(args)...);
+        return _emplace(p.first, p.second);
+    }
+
+    // only constructs the value if k isn't already in the tree
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &k, Args &&...args) {
+        return _emplace(k, std::forward<Args>(args)...);
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const K &k, M &&m) {
+        std::pair<iterator, bool> r = _emplace(k, std::forward<M>(m));
+        if (!r.second) {
+            _value(r.first._i) = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    // erasing only invalidates iterators to the erased pair, the
+    // tombstone it leaves and any shrinking wait for the next insert,
+    // inserts, compact, and shrink_to_fit may move everything, and
+    // growing or shrinking remaps the file, so pointers into it go too
+    void erase(iterator p) {
+        _setdeleted(p._i, true);
+        _header->size -= 1;
+        _header->tombstones += 1;
+    }
+
+    // rebuilds the tree in place without any tombstones
+    void compact() {
+        _rebalance(0, _header->size);
+
+        if (_header->size == 0) {
+            _sentinel();
+        }
+    }
+
+    // compacts the tree and shrinks the file to the smallest array
+    // that fits it
+    void shrink_to_fit() {
+        if (_fit(_header->size) < _header->height) {
+            _shrink(_fit(_header->size));
+        }
+    }
+};
+
+template <typename K, typename V, typename C, typename A>
+class mapped_sgtree<K, V, C, A>::iterator {
+private:
+    friend mapped_sgtree;
+    mapped_sgtree *_tree;
+    size_t _i;
+
+    iterator(mapped_sgtree *tree, size_t i)
+        : _tree(tree), _i(i) {
+    }
+
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef std::pair<K, V> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::pair<K, V> *pointer;
+    typedef std::pair<K, V> &reference;
+
+    reference operator*() { return _tree->_pairs[_i]; }
+    pointer operator->() { return &_tree->_pairs[_i]; }
+
+    friend bool operator==(const iterator &a, const iterator &b) {
+        return a._i == b._i;
+    }
+
+    friend bool operator!=(const iterator &a, const iterator &b) {
+        return a._i != b._i;
+    }
+
+    iterator &operator++() {
+        _i = _tree->_succ(_i);
+        return *this;
+    }
+
+    iterator operator++(int) {
+        iterator old = *this;
+        _i = _tree->_succ(_i);
+        return old;
+    }
+
+    iterator &operator--() {
+        // end sits past the largest slot, so it steps back from there
+        _i = (_i < _tree->_capacity) ? _tree->_pred(_i) : _tree->_largest(0);
+        return *this;
+    }
+
+    iterator operator--(int) {
+        iterator old = *this;
+        operator--();
+        return old;
+    }
+};
+
+#endif
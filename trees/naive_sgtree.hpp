@@ -9,11 +9,34 @@
 #define NAIVE_SGTREE_HPP
 
 #include <functional>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
 #include <ratio>
+#include <cmath>
+#include "snapshot.hpp"
+
+// Batches smaller than 1/N of the tree are applied one at a time,
+// anything larger is merged with the tree and rebuilt in one pass
+#ifndef NAIVE_SGTREE_BATCH
+#define NAIVE_SGTREE_BATCH 8
+#endif
+
+// Nodes are allocated in chunks that grow with the tree up to this
+// many nodes, larger chunks mean fewer allocations but more memory
+// sitting unused in the newest chunk
+#ifndef NAIVE_SGTREE_SLAB
+#define NAIVE_SGTREE_SLAB 1024
+#endif
 
 template <typename K, typename V,
     typename C=std::less<K>,
-    typename A=std::ratio<3,4>>
+    typename A=std::ratio<3,4>,
+    typename W=std::false_type,
+    typename L=std::allocator<typename std::conditional<
+        std::is_void<V>::value, K, std::pair<const K, V>>::type>>
 class naive_sgtree;
 
 template <typename K, typename V, typename C=std::less<K>>
@@ -27,30 +50,196 @@ using naive_sgtree78 = naive_sgtree<K, V, C, std::ratio<7,8>>;
 template <typename K, typename V, typename C=std::less<K>>
 using naive_sgtree11 = naive_sgtree<K, V, C, std::ratio<1,1>>;
 
-template <typename K, typename V, typename C, typename A>
+// Keeps the weight of each subtree in its root node so that finding
+// a scapegoat or an order statistic doesn't need to walk any subtrees
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename A=std::ratio<3,4>,
+    typename L=std::allocator<std::pair<const K, V>>>
+using naive_wsgtree = naive_sgtree<K, V, C, A, std::true_type, L>;
+
+// Sets are trees with void values, nodes only hold keys and iterators
+// hand out const references to keys
+template <typename K,
+    typename C=std::less<K>,
+    typename A=std::ratio<3,4>,
+    typename L=std::allocator<K>>
+using naive_sgtree_set = naive_sgtree<K, void, C, A, std::false_type, L>;
+
+template <typename K,
+    typename C=std::less<K>,
+    typename A=std::ratio<3,4>,
+    typename L=std::allocator<K>>
+using naive_wsgtree_set = naive_sgtree<K, void, C, A, std::true_type, L>;
+
+template <typename K, typename U, typename C, typename A, typename W,
+    typename L>
 class naive_sgtree {
 private:
-    struct node {
+    // a void value makes the tree a set, internally sets have empty
+    // values that are never stored
+    struct _none {};
+    typedef std::is_void<U> _set;
+    typedef typename std::conditional<_set::value, _none, U>::type V;
+
+    // weights only take up space when asked for
+    template <bool B, typename D=void>
+    struct weighted {
+    };
+
+    template <typename D>
+    struct weighted<true, D> {
+        size_t weight;
+    };
+
+    // and values only when there are any
+    template <bool B, typename D=void>
+    struct slotted {
+        std::pair<K, V> pair;
+
+        template <typename KK, typename... Args>
+        explicit slotted(KK &&k, Args &&...args)
+            : pair(std::piecewise_construct,
+                std::forward_as_tuple(std::forward<KK>(k)),
+                std::forward_as_tuple(std::forward<Args>(args)...)) {
+        }
+
+        K &key() { return pair.first; }
+        V &value() { return pair.second; }
+        std::pair<K, V> &ref() { return pair; }
+    };
+
+    template <typename D>
+    struct slotted<true, D> {
+        K k;
+
+        template <typename KK, typename... Args>
+        explicit slotted(KK &&k, Args &&...)
+            : k(std::forward<KK>(k)) {
+        }
+
+        K &key() { return k; }
+        const K &ref() { return k; }
+
+        V &value() {
+            // sets have nowhere to keep values, but they're all the same
+            static V none;
+            return none;
+        }
+    };
+
+    struct node : weighted<W::value> {
         node *parent;
         node *left;
         node *right;
-        std::pair<K, V> pair;
+        slotted<_set::value> slot;
+
+        template <typename KK, typename... Args>
+        node(node *parent, KK &&k, Args &&...args)
+            : parent(parent)
+            , left(nullptr)
+            , right(nullptr)
+            , slot(std::forward<KK>(k), std::forward<Args>(args)...) {
+        }
+    };
+
+    // the tree owns the memory for its nodes, chunks of cells that are
+    // handed out in order, erased nodes go on a free list that's used
+    // before anything new, the first cell of a chunk links it to the
+    // previous chunk and remembers its size
+    union _cell {
+        struct {
+            _cell *next;
+            size_t count;
+        } chunk;
+        _cell *free;
+        typename std::aligned_storage<sizeof(node), alignof(node)>::type
+            storage;
     };
 
     C _less;
+    L _allocator;
     constexpr static double _alpha = double(A::num)/double(A::den);
 
     node *_root;
     size_t _size;
 
+    _cell *_chunks;
+    _cell *_free;
+    size_t _carved;
+
+    size_t _depthlimit;
+    size_t _depthlower;
+    size_t _depthupper;
+
 public:
     naive_sgtree()
-        : _root(nullptr)
-        , _size(0) {
+        : naive_sgtree(L()) {
+    }
+
+    explicit naive_sgtree(const L &allocator)
+        : _allocator(allocator)
+        , _root(nullptr)
+        , _size(0)
+        , _chunks(nullptr)
+        , _free(nullptr)
+        , _carved(0)
+        , _depthlimit(0)
+        , _depthlower(0)
+        , _depthupper(0) {
+    }
+
+    template <typename It>
+    naive_sgtree(It first, It last, const L &allocator=L())
+        : naive_sgtree(allocator) {
+        assign(first, last);
     }
 
     ~naive_sgtree() {
-        _del(_root);
+        _del();
+    }
+
+    L get_allocator() const {
+        return _allocator;
+    }
+
+    // builds a perfectly balanced tree from a range of key-value
+    // pairs, or keys for sets, sorted ranges are placed directly,
+    // anything else is sorted first, only the first of any duplicate
+    // keys is kept
+    template <typename It>
+    void assign(It first, It last) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        _assign(_input<It>(first), _input<It>(last));
+    }
+
+    // writes the pairs in order to a stream, see snapshot.hpp for
+    // the format and how to write other types
+    void save(std::ostream &out) {
+        snapshot_save<K, V>(out, size(),
+                _input<iterator>(begin()), _input<iterator>(end()));
+    }
+
+    // replaces the tree with a snapshot written by save, pairs are
+    // built into a balanced tree as they're read, so the snapshot
+    // is never held in memory, a damaged snapshot leaves the tree
+    // empty and returns false
+    bool load(std::istream &in) {
+        snapshot_reader<K, V, C> r(in, _less);
+        _del();
+        if (r.checked()) {
+            _load(std::make_move_iterator(r.begin()), r.size());
+        } else {
+            _stream(r);
+        }
+
+        if (!r.ok()) {
+            _del();
+            _load(std::make_move_iterator(r.begin()), 0);
+        }
+        return r.ok();
     }
 
     size_t size() const {
@@ -84,12 +273,284 @@ private:
         }
     }
 
-    static void _del(node *n) {
-        if (n) {
-            _del(n->left);
-            _del(n->right);
-            delete n;
+    template <typename Q>
+    node *_find(const Q &k) {
+        node *n = _root;
+
+        while (n) {
+            if (_less(k, n->slot.key())) {
+                n = n->left;
+            } else if (_less(n->slot.key(), k)) {
+                n = n->right;
+            } else {
+                return n;
+            }
+        }
+
+        return nullptr;
+    }
+
+    template <typename Q>
+    node *_seek(const Q &k, bool upper) {
+        // the last node we went left at is the first key past k
+        node *n = _root;
+        node *b = nullptr;
+
+        while (n) {
+            if (upper ? _less(k, n->slot.key()) : !_less(n->slot.key(), k)) {
+                b = n;
+                n = n->left;
+            } else {
+                n = n->right;
+            }
         }
+
+        return b;
+    }
+
+    // lets a range of keys stand in for a range of pairs, so sets can
+    // share the bulk paths with maps
+    template <typename It>
+    class _keyed {
+    private:
+        It _it;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const K &, V> value_type;
+        typedef typename std::iterator_traits<It>::difference_type
+            difference_type;
+        typedef value_type *pointer;
+        typedef value_type reference;
+
+        explicit _keyed(It it)
+            : _it(it) {
+        }
+
+        reference operator*() { return reference(*_it, V()); }
+
+        friend bool operator==(const _keyed &a, const _keyed &b) {
+            return a._it == b._it;
+        }
+
+        friend bool operator!=(const _keyed &a, const _keyed &b) {
+            return a._it != b._it;
+        }
+
+        _keyed &operator++() {
+            ++_it;
+            return *this;
+        }
+    };
+
+    template <typename It>
+    using _input = typename std::conditional<_set::value,
+        _keyed<It>, It>::type;
+
+    template <typename It>
+    void _assign(It first, It last) {
+        typedef typename std::iterator_traits<It>::value_type T;
+        _del();
+
+        size_t n = std::distance(first, last);
+        if (std::adjacent_find(first, last, [this](const T &a, const T &b) {
+                    return !_less(a.first, b.first);
+                }) == last) {
+            _load(first, n);
+            return;
+        }
+
+        std::pair<K, V> *temp = _allocate<std::pair<K, V>>(n);
+        size_t j = 0;
+        for (It i = first; i != last; ++i) {
+            new (&temp[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        std::stable_sort(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        size_t m = std::unique(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return !_less(a.first, b.first);
+                }) - temp;
+
+        _load(std::make_move_iterator(temp), m);
+
+        for (j = 0; j < n; j++) {
+            temp[j].~pair();
+        }
+        _deallocate(temp, n);
+    }
+
+    template <typename It>
+    void _load(It first, size_t n) {
+        // the tree is empty, so all n nodes can go in one chunk
+        if (n > 0) {
+            _grow(n);
+        }
+        _root = _load(first, n, nullptr);
+        _size = n;
+    }
+
+    template <typename It>
+    node *_load(It &it, size_t len, node *p) {
+        // built in order so sorted input can be consumed as it goes
+        if (len == 0) {
+            return nullptr;
+        }
+
+        node *l = _load(it, len/2, nullptr);
+        node *n = _new(p, (*it).first, (*it).second);
+        ++it;
+        n->left = l;
+        if (l) {
+            l->parent = n;
+        }
+        n->right = _load(it, len-(len/2+1), n);
+        _reweigh(n, W());
+        return n;
+    }
+
+    // a count nothing vouches for only goes as far as the pairs do, so
+    // nodes are made as the pairs arrive, strung together through their
+    // right links, and only relinked into a balanced tree at the end
+    template <typename R>
+    void _stream(R &r) {
+        auto it = std::make_move_iterator(r.begin());
+        node *tail = nullptr;
+        _size = 0;
+        for (; r.size() > 0 && r.ok(); ++it) {
+            node *n = _new(nullptr, (*it).first, (*it).second);
+            if (tail) {
+                tail->right = n;
+            } else {
+                _root = n;
+            }
+            tail = n;
+            _size += 1;
+        }
+
+        if (r.ok()) {
+            node *list = _root;
+            _root = _relink(list, _size, nullptr);
+        }
+    }
+
+    node *_relink(node *&list, size_t len, node *p) {
+        if (len == 0) {
+            return nullptr;
+        }
+
+        node *l = _relink(list, len/2, nullptr);
+        node *n = list;
+        list = list->right;
+        n->parent = p;
+        n->left = l;
+        if (l) {
+            l->parent = n;
+        }
+        n->right = _relink(list, len-(len/2+1), n);
+        _reweigh(n, W());
+        return n;
+    }
+
+    template <typename T>
+    T *_allocate(size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        TL a(_allocator);
+        return std::allocator_traits<TL>::allocate(a, n);
+    }
+
+    template <typename T>
+    void _deallocate(T *p, size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        TL a(_allocator);
+        std::allocator_traits<TL>::deallocate(a, p, n);
+    }
+
+    void _grow(size_t n) {
+        _cell *c = _allocate<_cell>(n+1);
+        c->chunk.next = _chunks;
+        c->chunk.count = n+1;
+        _chunks = c;
+        _carved = 1;
+    }
+
+    template <typename... Args>
+    node *_new(Args &&...args) {
+        typedef typename std::allocator_traits<L>::
+            template rebind_alloc<node> NL;
+        NL a(_allocator);
+
+        _cell *c = _free;
+        if (c) {
+            _free = c->free;
+        } else {
+            // with nothing free every carved cell is in use, so a
+            // chunk the size of the tree doubles its capacity
+            if (!_chunks || _carved == _chunks->chunk.count) {
+                _grow(std::min<size_t>(
+                    std::max<size_t>(_size, 8), NAIVE_SGTREE_SLAB));
+            }
+            c = &_chunks[_carved];
+        }
+
+        node *n = reinterpret_cast<node*>(&c->storage);
+        std::allocator_traits<NL>::construct(a, n, std::forward<Args>(args)...);
+
+        // a new cell only counts once its node is built, so a throwing
+        // constructor doesn't leave a hole
+        if (c == &_chunks[_carved]) {
+            _carved += 1;
+        }
+        return n;
+    }
+
+    void _delete(node *n) {
+        typedef typename std::allocator_traits<L>::
+            template rebind_alloc<node> NL;
+        NL a(_allocator);
+        std::allocator_traits<NL>::destroy(a, n);
+
+        _cell *c = reinterpret_cast<_cell*>(n);
+        c->free = _free;
+        _free = c;
+    }
+
+    // drops every node at once, nodes are only visited if they have
+    // something to destroy, rotating left children up walks the tree
+    // without recursion, and then the chunks are released in bulk
+    void _del() {
+        typedef typename std::allocator_traits<L>::
+            template rebind_alloc<node> NL;
+        NL a(_allocator);
+
+        if (!std::is_trivially_destructible<node>::value) {
+            node *n = _root;
+            while (n) {
+                if (n->left) {
+                    node *l = n->left;
+                    n->left = l->right;
+                    l->right = n;
+                    n = l;
+                } else {
+                    node *r = n->right;
+                    std::allocator_traits<NL>::destroy(a, n);
+                    n = r;
+                }
+            }
+        }
+
+        while (_chunks) {
+            _cell *c = _chunks;
+            _chunks = c->chunk.next;
+            _deallocate(c, c->chunk.count);
+        }
+
+        _root = nullptr;
+        _free = nullptr;
+        _carved = 0;
     }
 
     size_t _weigh(node *n) {
@@ -97,11 +558,60 @@ private:
             return 0;
         }
 
+        return _weigh(n, W());
+    }
+
+    size_t _weigh(node *n, std::false_type) {
         return _weigh(n->left) + _weigh(n->right) + 1;
     }
 
+    static size_t _weigh(node *n, std::true_type) {
+        return n->weight;
+    }
+
+    void _reweigh(node *, std::false_type) {
+    }
+
+    void _reweigh(node *n, std::true_type) {
+        n->weight = _weigh(n->left) + _weigh(n->right) + 1;
+    }
+
+    static void _propagate(node *, ssize_t, std::false_type) {
+    }
+
+    static void _propagate(node *n, ssize_t d, std::true_type) {
+        for (; n; n = n->parent) {
+            n->weight += d;
+        }
+    }
+
+    size_t _maxdepth() {
+        // log(size)/log(1/alpha) rounded down, only recomputed when
+        // the size leaves [_depthlower, _depthupper)
+        if (A::num >= A::den) {
+            return size_t(-1) >> 1;
+        }
+
+        if (_size < _depthlower || _size >= _depthupper) {
+            constexpr double ialpha = double(A::den)/double(A::num);
+            double t = 1;
+            _depthlimit = 0;
+            while (t*ialpha <= _size) {
+                t *= ialpha;
+                _depthlimit += 1;
+            }
+
+            _depthlower = ceil(t);
+            _depthupper = ceil(t*ialpha);
+        }
+
+        return _depthlimit;
+    }
+
     std::pair<node*, size_t> _scapegoat(node *n) {
-        size_t w = 1;
+        // after erases the parent we're inserting under may already
+        // have a child
+        size_t w = _weigh(n);
 
         while (true) {
             node *p = n->parent;
@@ -128,11 +638,12 @@ private:
         n->parent = p;
         n->left = _build(ns, i, n);
         n->right = _build(ns+(i+1), len-(i+1), n);
+        _reweigh(n, W());
         return n;
     }
 
     node *_rebalance(node *n, size_t w) {
-        node **ns = static_cast<node**>(malloc(w*sizeof(node*)));
+        node **ns = _allocate<node*>(w);
         node *p = n->parent;
         n = _smallest(n);
         for (size_t i = 0; i < w; i++) {
@@ -141,11 +652,21 @@ private:
         }
 
         node *balanced = _build(ns, w, p);
-        free(ns);
+        _deallocate(ns, w);
         return balanced;
     }
 
 public:
+    typedef typename std::conditional<_set::value,
+        K,
+        std::pair<K, V>>::type value_type;
+    typedef typename std::conditional<_set::value,
+        const K &,
+        std::pair<K, V> &>::type reference;
+    typedef typename std::conditional<_set::value,
+        const K *,
+        std::pair<K, V> *>::type pointer;
+
     class iterator;
 
     iterator begin() {
@@ -158,12 +679,93 @@ public:
 
 public:
     iterator find(const K &k) {
+        return iterator(_find(k));
+    }
+
+    // transparent comparators can look up anything comparable
+    // with K without building a temporary key
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator find(const Q &k) {
+        return iterator(_find(k));
+    }
+
+    size_t count(const K &k) {
+        return find(k) != end();
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    size_t count(const Q &k) {
+        return find(k) != end();
+    }
+
+    iterator lower_bound(const K &k) {
+        return iterator(_seek(k, false));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator lower_bound(const Q &k) {
+        return iterator(_seek(k, false));
+    }
+
+    iterator upper_bound(const K &k) {
+        return iterator(_seek(k, true));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator upper_bound(const Q &k) {
+        return iterator(_seek(k, true));
+    }
+
+    std::pair<iterator, iterator> equal_range(const K &k) {
+        // keys are unique, so the range is at most one past lower_bound
+        node *n = _seek(k, false);
+        if (n && !_less(k, n->slot.key())) {
+            return std::make_pair(iterator(n), iterator(_succ(n)));
+        }
+        return std::make_pair(iterator(n), iterator(n));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    std::pair<iterator, iterator> equal_range(const Q &k) {
+        node *n = _seek(k, false);
+        if (n && !_less(k, n->slot.key())) {
+            return std::make_pair(iterator(n), iterator(_succ(n)));
+        }
+        return std::make_pair(iterator(n), iterator(n));
+    }
+
+    // order statistics, these are O(log n) when weights are kept,
+    // otherwise every subtree we skip over has to be walked
+    size_t rank(const K &k) {
+        node *n = _root;
+        size_t r = 0;
+
+        while (n) {
+            if (_less(n->slot.key(), k)) {
+                r += _weigh(n->left) + 1;
+                n = n->right;
+            } else {
+                n = n->left;
+            }
+        }
+
+        return r;
+    }
+
+    iterator select(size_t i) {
         node *n = _root;
 
         while (n) {
-            if (_less(k, n->pair.first)) {
+            size_t lw = _weigh(n->left);
+            if (i < lw) {
                 n = n->left;
-            } else if (_less(n->pair.first, k)) {
+            } else if (i > lw) {
+                i -= lw + 1;
                 n = n->right;
             } else {
                 return iterator(n);
@@ -173,83 +775,337 @@ public:
         return end();
     }
 
-    V &operator[](const K &k) {
+    // number of keys in [lo, hi)
+    size_t count(const K &lo, const K &hi) {
+        if (!_less(lo, hi)) {
+            return 0;
+        }
+
+        return rank(hi) - rank(lo);
+    }
+
+private:
+    template <typename KK, typename... Args>
+    std::pair<iterator, bool> _emplace(KK &&k, Args &&...args) {
         node *n = _root;
         node *parent = _root;
         node **branch = &_root;
         size_t depth = 0;
 
-        while (n) {
-            if (_less(k, n->pair.first)) {
-                parent = n;
-                branch = &n->left;
-                n = n->left;
-                depth += 1;
-            } else if (_less(n->pair.first, k)) {
-                parent = n;
-                branch = &n->right;
-                n = n->right;
-                depth += 1;
-            } else {
-                return n->pair.second;
+        while (true) {
+            while (n) {
+                if (_less(k, n->slot.key())) {
+                    parent = n;
+                    branch = &n->left;
+                    n = n->left;
+                    depth += 1;
+                } else if (_less(n->slot.key(), k)) {
+                    parent = n;
+                    branch = &n->right;
+                    n = n->right;
+                    depth += 1;
+                } else {
+                    return std::make_pair(iterator(n), false);
+                }
             }
-        }
 
-        if (_size > 0 && depth > log(_size)/log(1.0/_alpha)+1) {
-            assert(!parent->left && !parent->right);
-            std::pair<node*, size_t> sg = _scapegoat(parent);
-            node *parent = sg.first->parent;
-            node **branch = !parent ? &_root :
-                (sg.first == parent->left) ?  &parent->left : &parent->right;
-            *branch = _rebalance(sg.first, sg.second);
-            return operator[](k);
+            if (_size > 0 && depth > _maxdepth() + 1) {
+                std::pair<node*, size_t> sg = _scapegoat(parent);
+                parent = sg.first->parent;
+                branch = !parent ? &_root :
+                    (sg.first == parent->left) ?  &parent->left : &parent->right;
+                *branch = _rebalance(sg.first, sg.second);
+
+                // only the scapegoat's subtree moved, so the search
+                // can pick back up from there
+                n = *branch;
+                depth = 0;
+                for (node *p = parent; p; p = p->parent) {
+                    depth += 1;
+                }
+                continue;
+            }
+
+            break;
         }
 
-        n = new node;
-        n->parent = parent;
-        n->left = nullptr;
-        n->right = nullptr;
-        n->pair = std::pair<K, V>(k, V());
+        n = _new(parent,
+                std::forward<KK>(k), std::forward<Args>(args)...);
         *branch = n;
         _size += 1;
 
-        return n->pair.second;
+        _reweigh(n, W());
+        _propagate(parent, +1, W());
+
+        return std::make_pair(iterator(n), true);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> _emplacefrom(std::false_type, Args &&...args) {
+        std::pair<K, V> p(std::forward<Args>(args)...);
+        return _emplace(std::move(p.first), std::move(p.second));
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> _emplacefrom(std::true_type, Args &&...args) {
+        K k(std::forward<Args>(args)...);
+        return _emplace(std::move(k));
+    }
+
+public:
+    // maps only, a set has no values to hand out
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    V &operator[](const K &k) {
+        return _emplace(k).first._node->slot.value();
+    }
+
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    V &operator[](K &&k) {
+        return _emplace(std::move(k)).first._node->slot.value();
+    }
+
+    // sets are only given keys
+    template <typename SS=_set,
+        typename=typename std::enable_if<SS::value>::type>
+    std::pair<iterator, bool> insert(const K &k) {
+        return _emplace(k);
+    }
+
+    template <typename SS=_set,
+        typename=typename std::enable_if<SS::value>::type>
+    std::pair<iterator, bool> insert(K &&k) {
+        return _emplace(std::move(k));
+    }
+
+    // constructs a pair from args, or just the key for sets, like
+    // std::map this builds it before knowing if the key is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        return _emplacefrom(_set(), std::forward<Args>(args)...);
+    }
+
+    // only constructs the value if k isn't already in the tree
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type,
+        typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &k, Args &&...args) {
+        return _emplace(k, std::forward<Args>(args)...);
+    }
+
+    template <typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type,
+        typename... Args>
+    std::pair<iterator, bool> try_emplace(K &&k, Args &&...args) {
+        return _emplace(std::move(k), std::forward<Args>(args)...);
+    }
+
+    template <typename M, typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    std::pair<iterator, bool> insert_or_assign(const K &k, M &&m) {
+        std::pair<iterator, bool> r = _emplace(k, std::forward<M>(m));
+        if (!r.second) {
+            r.first._node->slot.value() = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    template <typename M, typename SS=_set,
+        typename=typename std::enable_if<!SS::value>::type>
+    std::pair<iterator, bool> insert_or_assign(K &&k, M &&m) {
+        std::pair<iterator, bool> r =
+                _emplace(std::move(k), std::forward<M>(m));
+        if (!r.second) {
+            r.first._node->slot.value() = std::forward<M>(m);
+        }
+        return r;
     }
 
     void erase(iterator p) {
+        // a node with two children is replaced by its successor, the
+        // node itself moves rather than its pair, so iterators to
+        // anything else stay valid
         node *n = p._node;
+        node *x;
+        node *d;
         if (n->left && n->right) {
             node *r = _smallest(n->right);
-            std::swap(r->pair, n->pair);
-            n = r;
+            d = r;
+            if (r != n->right) {
+                d = r->parent;
+                d->left = r->right;
+                if (r->right) {
+                    r->right->parent = d;
+                }
+                r->right = n->right;
+                r->right->parent = r;
+            }
+            r->left = n->left;
+            r->left->parent = r;
+
+            // and its weight, which only needs to drop by one
+            static_cast<weighted<W::value>&>(*r) = *n;
+            x = r;
+        } else {
+            x = n->left ? n->left : n->right;
+            d = n->parent;
         }
 
-        node **branch;
         if (!n->parent) {
-            branch = &_root;
+            _root = x;
         } else if (n->parent->left == n) {
-            branch = &n->parent->left;
+            n->parent->left = x;
         } else {
-            branch = &n->parent->right;
+            n->parent->right = x;
         }
 
-        if (n->left) {
-            n->left->parent = n->parent;
-            *branch = n->left;
-        } else if (n->right) {
-            n->right->parent = n->parent;
-            *branch = n->right;
-        } else {
-            *branch = nullptr;
+        if (x) {
+            x->parent = n->parent;
         }
 
-        delete n;
+        _propagate(d, -1, W());
+        _delete(n);
         _size -= 1;
     }
+
+    // applies a range of key-value upserts, or keys for sets, and then
+    // a range of keys to erase, later upserts of a key win and erases
+    // win over upserts
+    template <typename It, typename Jt>
+    void apply_batch(It ufirst, It ulast, Jt efirst, Jt elast) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<Jt>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        _apply_batch(_input<It>(ufirst), _input<It>(ulast), efirst, elast);
+    }
+
+private:
+    template <typename It, typename Jt>
+    void _apply_batch(It ufirst, It ulast, Jt efirst, Jt elast) {
+        size_t nu = std::distance(ufirst, ulast);
+        size_t ne = std::distance(efirst, elast);
+
+        if ((nu + ne)*NAIVE_SGTREE_BATCH < _size) {
+            // small batches only touch a few paths
+            for (It i = ufirst; i != ulast; ++i) {
+                _emplace((*i).first).first._node->slot.value() = (*i).second;
+            }
+
+            for (Jt i = efirst; i != elast; ++i) {
+                iterator f = find(*i);
+                if (f != end()) {
+                    erase(f);
+                }
+            }
+            return;
+        }
+
+        std::pair<K, V> *us = _allocate<std::pair<K, V>>(nu);
+        size_t j = 0;
+        for (It i = ufirst; i != ulast; ++i) {
+            new (&us[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        K *es = _allocate<K>(ne);
+        j = 0;
+        for (Jt i = efirst; i != elast; ++i) {
+            new (&es[j++]) K(*i);
+        }
+
+        std::stable_sort(us, us+nu,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        std::sort(es, es+ne, _less);
+
+        // collapse duplicate upserts into the last one
+        size_t mu = 0;
+        for (j = 0; j < nu; j++) {
+            if (mu > 0 && !_less(us[mu-1].first, us[j].first)) {
+                us[mu-1] = std::move(us[j]);
+            } else {
+                if (mu != j) {
+                    us[mu] = std::move(us[j]);
+                }
+                mu += 1;
+            }
+        }
+
+        // nodes can't be freed while we're still walking the tree
+        size_t no = _size;
+        node **os = _allocate<node*>(no);
+        node *n = _smallest(_root);
+        for (j = 0; j < _size; j++) {
+            os[j] = n;
+            n = _succ(n);
+        }
+
+        // merge the tree, upserts and erases into one sorted run of
+        // nodes, reusing the tree's nodes where we can
+        size_t nm = _size + mu;
+        node **ns = _allocate<node*>(nm);
+        size_t m = 0;
+        size_t a = 0;
+        size_t b = 0;
+        j = 0;
+        while (j < _size || a < mu) {
+            bool up = a < mu &&
+                (j >= _size || !_less(os[j]->slot.key(), us[a].first));
+            bool tie = up && j < _size &&
+                !_less(us[a].first, os[j]->slot.key());
+            const K &k = up ? us[a].first : os[j]->slot.key();
+
+            while (b < ne && _less(es[b], k)) {
+                b += 1;
+            }
+
+            if (b < ne && !_less(k, es[b])) {
+                if (!up || tie) {
+                    _delete(os[j]);
+                }
+            } else if (tie) {
+                os[j]->slot.value() = std::move(us[a].second);
+                ns[m++] = os[j];
+            } else if (up) {
+                n = _new(nullptr,
+                        std::move(us[a].first), std::move(us[a].second));
+                ns[m++] = n;
+            } else {
+                ns[m++] = os[j];
+            }
+
+            if (up) {
+                a += 1;
+            }
+
+            if (!up || tie) {
+                j += 1;
+            }
+        }
+
+        _root = _build(ns, m, nullptr);
+        _size = m;
+
+        for (j = 0; j < nu; j++) {
+            us[j].~pair();
+        }
+        for (j = 0; j < ne; j++) {
+            es[j].~K();
+        }
+        _deallocate(os, no);
+        _deallocate(ns, nm);
+        _deallocate(us, nu);
+        _deallocate(es, ne);
+    }
 };
 
-template <typename K, typename V, typename C, typename A>
-class naive_sgtree<K, V, C, A>::iterator {
+template <typename K, typename U, typename C, typename A, typename W,
+    typename L>
+class naive_sgtree<K, U, C, A, W, L>::iterator {
 private:
     friend naive_sgtree;
     node *_node;
@@ -259,8 +1115,14 @@ private:
     }
 
 public:
-    std::pair<K, V> &operator*() { return _node->pair; }
-    std::pair<K, V> *operator->() { return &_node->pair; }
+    typedef std::forward_iterator_tag iterator_category;
+    typedef typename naive_sgtree::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename naive_sgtree::pointer pointer;
+    typedef typename naive_sgtree::reference reference;
+
+    reference operator*() { return _node->slot.ref(); }
+    pointer operator->() { return &_node->slot.ref(); }
 
     friend bool operator==(const iterator &a, const iterator &b) {
         return a._node == b._node;
@@ -275,7 +1137,7 @@ public:
         return *this;
     }
 
-    iterator &operator++(int) {
+    iterator operator++(int) {
         iterator old = *this;
         _node = _succ(_node);
         return old;
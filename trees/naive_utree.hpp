@@ -9,8 +9,24 @@
 #define NAIVE_UTREE_HPP
 
 #include <functional>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <cstdlib>
+#include "snapshot.hpp"
+
+// Nodes are allocated in chunks that grow with the tree up to this
+// many nodes, larger chunks mean fewer allocations but more memory
+// sitting unused in the newest chunk
+#ifndef NAIVE_UTREE_SLAB
+#define NAIVE_UTREE_SLAB 1024
+#endif
 
-template <typename K, typename V, typename C=std::less<K>>
+template <typename K, typename V,
+    typename C=std::less<K>,
+    typename L=std::allocator<std::pair<const K, V>>>
 class naive_utree {
 private:
     struct node {
@@ -18,21 +34,136 @@ private:
         node *left;
         node *right;
         std::pair<K, V> pair;
+
+        template <typename KK, typename... Args>
+        node(node *parent, KK &&k, Args &&...args)
+            : parent(parent)
+            , left(nullptr)
+            , right(nullptr)
+            , pair(std::piecewise_construct,
+                std::forward_as_tuple(std::forward<KK>(k)),
+                std::forward_as_tuple(std::forward<Args>(args)...)) {
+        }
+    };
+
+    // the tree owns the memory for its nodes, chunks of cells that are
+    // handed out in order, erased nodes go on a free list that's used
+    // before anything new, the first cell of a chunk links it to the
+    // previous chunk and remembers its size
+    union _cell {
+        struct {
+            _cell *next;
+            size_t count;
+        } chunk;
+        _cell *free;
+        typename std::aligned_storage<sizeof(node), alignof(node)>::type
+            storage;
     };
 
     C _less;
+    L _allocator;
 
     node *_root;
     size_t _size;
 
+    _cell *_chunks;
+    _cell *_free;
+    size_t _carved;
+
 public:
     naive_utree()
-        : _root(nullptr)
-        , _size(0) {
+        : naive_utree(L()) {
+    }
+
+    explicit naive_utree(const L &allocator)
+        : _allocator(allocator)
+        , _root(nullptr)
+        , _size(0)
+        , _chunks(nullptr)
+        , _free(nullptr)
+        , _carved(0) {
+    }
+
+    template <typename It>
+    naive_utree(It first, It last, const L &allocator=L())
+        : naive_utree(allocator) {
+        assign(first, last);
     }
 
     ~naive_utree() {
-        _del(_root);
+        _del();
+    }
+
+    L get_allocator() const {
+        return _allocator;
+    }
+
+    // builds a perfectly balanced tree from a range of key-value
+    // pairs, sorted ranges are placed directly, anything else is sorted
+    // first, only the first of any duplicate keys is kept
+    template <typename It>
+    void assign(It first, It last) {
+        static_assert(std::is_base_of<std::forward_iterator_tag,
+                typename std::iterator_traits<It>::iterator_category>::value,
+            "ranges are read more than once, so they need forward iterators");
+        typedef typename std::iterator_traits<It>::value_type T;
+        _del();
+
+        size_t n = std::distance(first, last);
+        if (std::adjacent_find(first, last, [this](const T &a, const T &b) {
+                    return !_less(a.first, b.first);
+                }) == last) {
+            _load(first, n);
+            return;
+        }
+
+        std::pair<K, V> *temp = _allocate<std::pair<K, V>>(n);
+        size_t j = 0;
+        for (It i = first; i != last; ++i) {
+            new (&temp[j++]) std::pair<K, V>((*i).first, (*i).second);
+        }
+
+        std::stable_sort(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return _less(a.first, b.first);
+                });
+        size_t m = std::unique(temp, temp+n,
+                [this](const std::pair<K, V> &a, const std::pair<K, V> &b) {
+                    return !_less(a.first, b.first);
+                }) - temp;
+
+        _load(std::make_move_iterator(temp), m);
+
+        for (j = 0; j < n; j++) {
+            temp[j].~pair();
+        }
+        _deallocate(temp, n);
+    }
+
+    // writes the pairs in order to a stream, see snapshot.hpp for
+    // the format and how to write other types
+    void save(std::ostream &out) {
+        snapshot_save<K, V>(out, size(), begin(), end());
+    }
+
+    // replaces the tree with a snapshot written by save, pairs are
+    // built into a balanced tree as they're read, so the snapshot
+    // is never held in memory, a damaged snapshot leaves the tree
+    // empty and returns false
+    bool load(std::istream &in) {
+        snapshot_reader<K, V, C> r(in, _less);
+        _del();
+        if (r.checked()) {
+            _load(std::make_move_iterator(r.begin()), r.size());
+        } else {
+            _stream(r);
+        }
+
+        if (!r.ok()) {
+            _del();
+            _load(std::make_move_iterator(r.begin()), 0);
+        }
+        return r.ok();
     }
 
     size_t size() const {
@@ -66,12 +197,207 @@ private:
         }
     }
 
-    static void _del(node *n) {
-        if (n) {
-            _del(n->left);
-            _del(n->right);
-            delete n;
+    template <typename Q>
+    node *_find(const Q &k) {
+        node *n = _root;
+
+        while (n) {
+            if (_less(k, n->pair.first)) {
+                n = n->left;
+            } else if (_less(n->pair.first, k)) {
+                n = n->right;
+            } else {
+                return n;
+            }
+        }
+
+        return nullptr;
+    }
+
+    template <typename Q>
+    node *_seek(const Q &k, bool upper) {
+        // the last node we went left at is the first key past k
+        node *n = _root;
+        node *b = nullptr;
+
+        while (n) {
+            if (upper ? _less(k, n->pair.first) : !_less(n->pair.first, k)) {
+                b = n;
+                n = n->left;
+            } else {
+                n = n->right;
+            }
+        }
+
+        return b;
+    }
+
+    template <typename It>
+    void _load(It first, size_t n) {
+        // the tree is empty, so all n nodes can go in one chunk
+        if (n > 0) {
+            _grow(n);
+        }
+        _root = _load(first, n, nullptr);
+        _size = n;
+    }
+
+    template <typename It>
+    node *_load(It &it, size_t len, node *p) {
+        // built in order so sorted input can be consumed as it goes
+        if (len == 0) {
+            return nullptr;
+        }
+
+        node *l = _load(it, len/2, nullptr);
+        node *n = _new(p, (*it).first, (*it).second);
+        ++it;
+        n->left = l;
+        if (l) {
+            l->parent = n;
+        }
+        n->right = _load(it, len-(len/2+1), n);
+        return n;
+    }
+
+    // a count nothing vouches for only goes as far as the pairs do, so
+    // nodes are made as the pairs arrive, strung together through their
+    // right links, and only relinked into a balanced tree at the end
+    template <typename R>
+    void _stream(R &r) {
+        auto it = std::make_move_iterator(r.begin());
+        node *tail = nullptr;
+        _size = 0;
+        for (; r.size() > 0 && r.ok(); ++it) {
+            node *n = _new(nullptr, (*it).first, (*it).second);
+            if (tail) {
+                tail->right = n;
+            } else {
+                _root = n;
+            }
+            tail = n;
+            _size += 1;
+        }
+
+        if (r.ok()) {
+            node *list = _root;
+            _root = _relink(list, _size, nullptr);
+        }
+    }
+
+    node *_relink(node *&list, size_t len, node *p) {
+        if (len == 0) {
+            return nullptr;
+        }
+
+        node *l = _relink(list, len/2, nullptr);
+        node *n = list;
+        list = list->right;
+        n->parent = p;
+        n->left = l;
+        if (l) {
+            l->parent = n;
+        }
+        n->right = _relink(list, len-(len/2+1), n);
+        return n;
+    }
+
+    template <typename T>
+    T *_allocate(size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        TL a(_allocator);
+        return std::allocator_traits<TL>::allocate(a, n);
+    }
+
+    template <typename T>
+    void _deallocate(T *p, size_t n) {
+        typedef typename std::allocator_traits<L>::template rebind_alloc<T> TL;
+        TL a(_allocator);
+        std::allocator_traits<TL>::deallocate(a, p, n);
+    }
+
+    void _grow(size_t n) {
+        _cell *c = _allocate<_cell>(n+1);
+        c->chunk.next = _chunks;
+        c->chunk.count = n+1;
+        _chunks = c;
+        _carved = 1;
+    }
+
+    template <typename... Args>
+    node *_new(Args &&...args) {
+        typedef typename std::allocator_traits<L>::
+            template rebind_alloc<node> NL;
+        NL a(_allocator);
+
+        _cell *c = _free;
+        if (c) {
+            _free = c->free;
+        } else {
+            // with nothing free every carved cell is in use, so a
+            // chunk the size of the tree doubles its capacity
+            if (!_chunks || _carved == _chunks->chunk.count) {
+                _grow(std::min<size_t>(
+                    std::max<size_t>(_size, 8), NAIVE_UTREE_SLAB));
+            }
+            c = &_chunks[_carved];
         }
+
+        node *n = reinterpret_cast<node*>(&c->storage);
+        std::allocator_traits<NL>::construct(a, n, std::forward<Args>(args)...);
+
+        // a new cell only counts once its node is built, so a throwing
+        // constructor doesn't leave a hole
+        if (c == &_chunks[_carved]) {
+            _carved += 1;
+        }
+        return n;
+    }
+
+    void _delete(node *n) {
+        typedef typename std::allocator_traits<L>::
+            template rebind_alloc<node> NL;
+        NL a(_allocator);
+        std::allocator_traits<NL>::destroy(a, n);
+
+        _cell *c = reinterpret_cast<_cell*>(n);
+        c->free = _free;
+        _free = c;
+    }
+
+    // drops every node at once, nodes are only visited if they have
+    // something to destroy, rotating left children up walks the tree
+    // without recursion, and then the chunks are released in bulk
+    void _del() {
+        typedef typename std::allocator_traits<L>::
+            template rebind_alloc<node> NL;
+        NL a(_allocator);
+
+        if (!std::is_trivially_destructible<node>::value) {
+            node *n = _root;
+            while (n) {
+                if (n->left) {
+                    node *l = n->left;
+                    n->left = l->right;
+                    l->right = n;
+                    n = l;
+                } else {
+                    node *r = n->right;
+                    std::allocator_traits<NL>::destroy(a, n);
+                    n = r;
+                }
+            }
+        }
+
+        while (_chunks) {
+            _cell *c = _chunks;
+            _chunks = c->chunk.next;
+            _deallocate(c, c->chunk.count);
+        }
+
+        _root = nullptr;
+        _free = nullptr;
+        _carved = 0;
     }
 
 public:
@@ -87,22 +413,69 @@ public:
 
 public:
     iterator find(const K &k) {
-        node *n = _root;
+        return iterator(_find(k));
+    }
 
-        while (n) {
-            if (_less(k, n->pair.first)) {
-                n = n->left;
-            } else if (_less(n->pair.first, k)) {
-                n = n->right;
-            } else {
-                return iterator(n);
-            }
+    // transparent comparators can look up anything comparable
+    // with K without building a temporary key
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator find(const Q &k) {
+        return iterator(_find(k));
+    }
+
+    size_t count(const K &k) {
+        return find(k) != end();
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    size_t count(const Q &k) {
+        return find(k) != end();
+    }
+
+    iterator lower_bound(const K &k) {
+        return iterator(_seek(k, false));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator lower_bound(const Q &k) {
+        return iterator(_seek(k, false));
+    }
+
+    iterator upper_bound(const K &k) {
+        return iterator(_seek(k, true));
+    }
+
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    iterator upper_bound(const Q &k) {
+        return iterator(_seek(k, true));
+    }
+
+    std::pair<iterator, iterator> equal_range(const K &k) {
+        // keys are unique, so the range is at most one past lower_bound
+        node *n = _seek(k, false);
+        if (n && !_less(k, n->pair.first)) {
+            return std::make_pair(iterator(n), iterator(_succ(n)));
         }
+        return std::make_pair(iterator(n), iterator(n));
+    }
 
-        return end();
+    template <typename Q, typename CC=C,
+        typename=typename CC::is_transparent>
+    std::pair<iterator, iterator> equal_range(const Q &k) {
+        node *n = _seek(k, false);
+        if (n && !_less(k, n->pair.first)) {
+            return std::make_pair(iterator(n), iterator(_succ(n)));
+        }
+        return std::make_pair(iterator(n), iterator(n));
     }
 
-    V &operator[](const K &k) {
+private:
+    template <typename KK, typename... Args>
+    std::pair<iterator, bool> _emplace(KK &&k, Args &&...args) {
         node *n = _root;
         node *parent = _root;
         node **branch = &_root;
@@ -117,55 +490,107 @@ public:
                 branch = &n->right;
                 n = n->right;
             } else {
-                return n->pair.second;
+                return std::make_pair(iterator(n), false);
             }
         }
 
-        n = new node;
-        n->parent = parent;
-        n->left = nullptr;
-        n->right = nullptr;
-        n->pair = std::pair<K, V>(k, V());
+        n = _new(parent,
+                std::forward<KK>(k), std::forward<Args>(args)...);
         *branch = n;
         _size += 1;
 
-        return n->pair.second;
+        return std::make_pair(iterator(n), true);
+    }
+
+public:
+    V &operator[](const K &k) {
+        return _emplace(k).first->second;
+    }
+
+    V &operator[](K &&k) {
+        return _emplace(std::move(k)).first->second;
+    }
+
+    // constructs a pair from args, like std::map this builds the pair
+    // before knowing if the key is already there
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        std::pair<K, V> p(std::forward<Args>(args)...);
+        return _emplace(std::move(p.first), std::move(p.second));
+    }
+
+    // only constructs the value if k isn't already in the tree
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const K &k, Args &&...args) {
+        return _emplace(k, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K &&k, Args &&...args) {
+        return _emplace(std::move(k), std::forward<Args>(args)...);
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(const K &k, M &&m) {
+        std::pair<iterator, bool> r = _emplace(k, std::forward<M>(m));
+        if (!r.second) {
+            r.first->second = std::forward<M>(m);
+        }
+        return r;
+    }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(K &&k, M &&m) {
+        std::pair<iterator, bool> r =
+                _emplace(std::move(k), std::forward<M>(m));
+        if (!r.second) {
+            r.first->second = std::forward<M>(m);
+        }
+        return r;
     }
 
     void erase(iterator p) {
+        // a node with two children is replaced by its successor, the
+        // node itself moves rather than its pair, so iterators to
+        // anything else stay valid
         node *n = p._node;
+        node *x;
         if (n->left && n->right) {
             node *r = _smallest(n->right);
-            std::swap(r->pair, n->pair);
-            n = r;
+            if (r != n->right) {
+                r->parent->left = r->right;
+                if (r->right) {
+                    r->right->parent = r->parent;
+                }
+                r->right = n->right;
+                r->right->parent = r;
+            }
+            r->left = n->left;
+            r->left->parent = r;
+            x = r;
+        } else {
+            x = n->left ? n->left : n->right;
         }
 
-        node **branch;
         if (!n->parent) {
-            branch = &_root;
+            _root = x;
         } else if (n->parent->left == n) {
-            branch = &n->parent->left;
+            n->parent->left = x;
         } else {
-            branch = &n->parent->right;
+            n->parent->right = x;
         }
 
-        if (n->left) {
-            n->left->parent = n->parent;
-            *branch = n->left;
-        } else if (n->right) {
-            n->right->parent = n->parent;
-            *branch = n->right;
-        } else {
-            *branch = nullptr;
+        if (x) {
+            x->parent = n->parent;
         }
 
-        delete n;
+        _delete(n);
         _size -= 1;
     }
 };
 
-template <typename K, typename V, typename C>
-class naive_utree<K, V, C>::iterator {
+template <typename K, typename V, typename C, typename L>
+class naive_utree<K, V, C, L>::iterator {
 private:
     friend naive_utree;
     node *_node;
@@ -191,7 +616,7 @@ public:
         return *this;
     }
 
-    iterator &operator++(int) {
+    iterator operator++(int) {
         iterator old = *this;
         _node = _succ(_node);
         return old;
@@ -0,0 +1,321 @@
+/*
+ * Portable snapshots of sorted key-value pairs
+ *
+ * Copyright (c) 2016 Christopher Haster
+ * Distributed under the MIT license
+ */
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+// Bumped whenever the format changes, snapshots written with
+// any other version are refused
+#define SNAPSHOT_VERSION 1
+
+// Snapshots are a magic and version, the number of pairs, and then
+// every pair in sorted order, each written with snapshot_codec
+//
+// Specialize snapshot_codec to write a type some other way, anything
+// trivially copyable is written as raw bytes unless there's a better
+// encoding for it
+template <typename T, typename=void>
+struct snapshot_codec {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "no snapshot_codec for this type");
+
+    static void encode(std::ostream &out, const T &t) {
+        out.write(reinterpret_cast<const char*>(&t), sizeof(T));
+    }
+
+    static void decode(std::istream &in, T &t) {
+        in.read(reinterpret_cast<char*>(&t), sizeof(T));
+    }
+};
+
+// integers are little-endian no matter where they're written
+template <typename T>
+struct snapshot_codec<T, typename std::enable_if<
+        std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+    typedef typename std::make_unsigned<T>::type U;
+
+    static void encode(std::ostream &out, const T &t) {
+        char buf[sizeof(T)];
+        U u = t;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            buf[i] = char(uint8_t(u >> 8*i));
+        }
+        out.write(buf, sizeof(T));
+    }
+
+    static void decode(std::istream &in, T &t) {
+        char buf[sizeof(T)];
+        in.read(buf, sizeof(T));
+        U u = 0;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            u |= U(uint8_t(buf[i])) << 8*i;
+        }
+        t = T(u);
+    }
+};
+
+// floats go through the integer of the same size
+template <typename T>
+struct snapshot_codec<T, typename std::enable_if<
+        std::is_floating_point<T>::value &&
+        (sizeof(T) == 4 || sizeof(T) == 8)>::type> {
+    typedef typename std::conditional<sizeof(T) == 4,
+        uint32_t, uint64_t>::type U;
+
+    static void encode(std::ostream &out, const T &t) {
+        U u;
+        memcpy(&u, &t, sizeof(T));
+        snapshot_codec<U>::encode(out, u);
+    }
+
+    static void decode(std::istream &in, T &t) {
+        U u;
+        snapshot_codec<U>::decode(in, u);
+        memcpy(&t, &u, sizeof(T));
+    }
+};
+
+// empty types, like the values of a set, aren't written at all
+template <typename T>
+struct snapshot_codec<T, typename std::enable_if<
+        std::is_empty<T>::value>::type> {
+    static void encode(std::ostream &, const T &) {
+    }
+
+    static void decode(std::istream &, T &) {
+    }
+};
+
+// sizes are written in 7-bit groups, low bits first, so small
+// sizes only take a byte
+static inline void snapshot_putsize(std::ostream &out, uint64_t n) {
+    char buf[10];
+    size_t i = 0;
+    while (n >= 0x80) {
+        buf[i++] = char(0x80 | (n & 0x7f));
+        n >>= 7;
+    }
+    buf[i++] = char(n);
+    out.write(buf, i);
+}
+
+static inline uint64_t snapshot_getsize(std::istream &in) {
+    uint64_t n = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF) {
+            return 0;
+        }
+
+        n |= uint64_t(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return n;
+        }
+    }
+
+    in.setstate(std::ios::failbit);
+    return 0;
+}
+
+// strings are length-prefixed
+template <typename Ch, typename Tr, typename Al>
+struct snapshot_codec<std::basic_string<Ch, Tr, Al>> {
+    static void encode(std::ostream &out,
+            const std::basic_string<Ch, Tr, Al> &s) {
+        snapshot_putsize(out, s.size());
+        out.write(reinterpret_cast<const char*>(s.data()),
+                s.size()*sizeof(Ch));
+    }
+
+    static void decode(std::istream &in, std::basic_string<Ch, Tr, Al> &s) {
+        uint64_t n = snapshot_getsize(in);
+
+        // read in chunks so a damaged size can't ask for more
+        // memory than the stream actually has
+        s.clear();
+        while (in && s.size() < n) {
+            size_t m = std::min<uint64_t>(n - s.size(), 4096);
+            size_t i = s.size();
+            s.resize(i + m);
+            in.read(reinterpret_cast<char*>(&s[i]), m*sizeof(Ch));
+        }
+    }
+};
+
+static inline void snapshot_putheader(std::ostream &out, size_t n) {
+    out.write("sgsnap", 7);
+    out.put(char(SNAPSHOT_VERSION));
+    snapshot_putsize(out, n);
+}
+
+// reads the header, checked is false if the stream can't seek, in
+// which case nothing vouches for the count until the pairs arrive
+static inline bool snapshot_getheader(std::istream &in, size_t &n,
+        bool &checked) {
+    char magic[8];
+    in.read(magic, 8);
+    if (!in || memcmp(magic, "sgsnap", 7) != 0
+            || magic[7] != char(SNAPSHOT_VERSION)) {
+        return false;
+    }
+
+    n = snapshot_getsize(in);
+    if (!in) {
+        return false;
+    }
+
+    // a damaged count could ask for far more than the stream has,
+    // every pair takes at least a byte, so check when we can
+    std::streampos pos = in.tellg();
+    checked = pos != std::streampos(-1);
+    if (checked) {
+        in.seekg(0, std::ios::end);
+        std::streampos end = in.tellg();
+        in.seekg(pos);
+        if (uint64_t(end - pos) < n) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline bool snapshot_getheader(std::istream &in, size_t &n) {
+    bool checked;
+    return snapshot_getheader(in, n, checked);
+}
+
+// writes n pairs from a sorted range
+template <typename K, typename V, typename It>
+void snapshot_save(std::ostream &out, size_t n, It first, It last) {
+    snapshot_putheader(out, n);
+    for (It i = first; i != last; ++i) {
+        snapshot_codec<K>::encode(out, (*i).first);
+        snapshot_codec<V>::encode(out, (*i).second);
+    }
+}
+
+// reads pairs out of a snapshot one at a time, so a tree can be built
+// straight from the stream without holding a second copy, the pairs
+// are checked to be in order as they're read
+//
+// the count of a stream that can't seek, like a pipe, can't be checked
+// up front, so checked() is false and the count should only be trusted
+// as far as the pairs actually go, reading stops being ok() as soon as
+// the stream runs out
+template <typename K, typename V, typename C>
+class snapshot_reader {
+private:
+    std::istream &_in;
+    const C &_less;
+    size_t _n;
+    bool _ok;
+
+    // one pair of lookahead, so that the pair handed out can be moved
+    // from after we've checked it against the next one
+    std::pair<K, V> _pairs[2];
+    size_t _i;
+    bool _checked;
+
+    void _read(std::pair<K, V> &p) {
+        snapshot_codec<K>::decode(_in, p.first);
+        snapshot_codec<V>::decode(_in, p.second);
+    }
+
+    void _lookahead() {
+        if (_n > 1) {
+            _read(_pairs[_i^1]);
+            _ok = _ok && _in && _less(_pairs[_i].first, _pairs[_i^1].first);
+        }
+    }
+
+    void _next() {
+        _i ^= 1;
+        _n -= 1;
+        _lookahead();
+    }
+
+public:
+    class iterator;
+
+    // reads the header, a damaged header reads as no pairs
+    snapshot_reader(std::istream &in, const C &less)
+        : _in(in)
+        , _less(less)
+        , _n(0)
+        , _i(0)
+        , _checked(true) {
+        _ok = snapshot_getheader(_in, _n, _checked);
+        if (!_ok) {
+            _n = 0;
+            _checked = true;
+        }
+
+        if (_n > 0) {
+            _read(_pairs[0]);
+            _ok = bool(_in);
+        }
+        _lookahead();
+    }
+
+    // pairs left to read
+    size_t size() const {
+        return _n;
+    }
+
+    // false if the stream ran out or the pairs weren't in order
+    bool ok() const {
+        return _ok;
+    }
+
+    // false if nothing vouches for size(), storage shouldn't be
+    // sized from it
+    bool checked() const {
+        return _checked;
+    }
+
+    iterator begin() {
+        return iterator(this);
+    }
+};
+
+template <typename K, typename V, typename C>
+class snapshot_reader<K, V, C>::iterator {
+private:
+    snapshot_reader *_reader;
+
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::pair<K, V> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::pair<K, V> *pointer;
+    typedef std::pair<K, V> &reference;
+
+    explicit iterator(snapshot_reader *reader)
+        : _reader(reader) {
+    }
+
+    reference operator*() const { return _reader->_pairs[_reader->_i]; }
+    pointer operator->() const { return &_reader->_pairs[_reader->_i]; }
+
+    iterator &operator++() {
+        _reader->_next();
+        return *this;
+    }
+};
+
+#endif